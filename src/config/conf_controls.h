@@ -0,0 +1,215 @@
+#ifndef CONF_CONTROLS_H_INCLUDED
+#define CONF_CONTROLS_H_INCLUDED
+
+// board variant, the number of knobs fitted: 8, 16, 20 or 64
+#define CONF_BOARD_KNOBS             8
+
+// the controls, in the order they show up in controller_value[] and on
+// the CC numbers.  each entry is
+// CONF_CONTROL(AIN pin, mux channel, type, filter, curve) with the type
+// CTRL_TYPE_PITCHBEND, CTRL_TYPE_CC, CTRL_TYPE_CC14 (CC n and n+32 with
+// the full 12 bits, only up to CC 31, later controls fall back to 7 bit
+// CCs) or CTRL_TYPE_NRPN (14 bit NRPN, the control index is the parameter
+// number).  the mux channel is the input of the
+// external multiplexer on that AIN pin, 0 for pots wired straight to the
+// pin.  the filter is the list of stages from filter.h the control's raw
+// value goes through, FILTER_MAX_STAGES at most.  the curve from curve.h
+// (CURVE_LINEAR, CURVE_LOG, CURVE_EXP or CURVE_S) shapes the 7 bit CC
+// output, the other types ignore it.  the pin scan runs over every AIN from
+// CONF_SCAN_FIRST_AIN to CONF_SCAN_LAST_AIN, all pins in the table have
+// to be in that range
+// add FILTER_PREDICT(lead_ms, tau_ms) as the last stage to take out the
+// lag of the stages before it during fast sweeps
+#define CONF_FILTER_CC           { FILTER_OVERSAMPLE() }
+#define CONF_FILTER_PITCHBEND    { FILTER_OVERSAMPLE(), FILTER_EMA(4) }
+
+#if CONF_BOARD_KNOBS == 8
+#  define CONF_CONTROLS(CONF_CONTROL) \
+	CONF_CONTROL(12, 0, CTRL_TYPE_PITCHBEND, CONF_FILTER_PITCHBEND, CURVE_LINEAR) \
+	CONF_CONTROL(13, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL(14, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL(15, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL( 5, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL( 4, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL( 3, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL( 2, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR)
+#  define CONF_SCAN_FIRST_AIN        2
+#  define CONF_SCAN_LAST_AIN         15
+#elif CONF_BOARD_KNOBS == 16
+#  define CONF_CONTROLS(CONF_CONTROL) \
+	CONF_CONTROL(12, 0, CTRL_TYPE_PITCHBEND, CONF_FILTER_PITCHBEND, CURVE_LINEAR) \
+	CONF_CONTROL(13, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL(14, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL(15, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL( 5, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL( 4, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL( 3, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL( 2, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL( 6, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL( 7, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL( 8, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL( 9, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL(10, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL(11, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL(16, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL(17, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR)
+#  define CONF_SCAN_FIRST_AIN        2
+#  define CONF_SCAN_LAST_AIN         17
+#elif CONF_BOARD_KNOBS == 20
+// AIN1 is also VREFA, this variant uses VDDANA/2 as reference with the
+// ADC gain at 1/2 so the range still is 0 to VDDANA
+#  define CONF_CONTROLS(CONF_CONTROL) \
+	CONF_CONTROL(12, 0, CTRL_TYPE_PITCHBEND, CONF_FILTER_PITCHBEND, CURVE_LINEAR) \
+	CONF_CONTROL(13, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL(14, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL(15, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL( 5, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL( 4, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL( 3, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL( 2, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL( 6, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL( 7, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL( 8, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL( 9, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL(10, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL(11, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL(16, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL(17, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL(18, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL(19, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL( 0, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL( 1, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR)
+#  define CONF_SCAN_FIRST_AIN        0
+#  define CONF_SCAN_LAST_AIN         19
+#  define CONF_ADC_REFERENCE         ADC_REFERENCE_INTVCC1
+#  define CONF_ADC_GAIN              ADC_GAIN_FACTOR_DIV2
+#elif CONF_BOARD_KNOBS == 64
+// four 74HC4067 on AIN12-15, their address lines tied together
+#  define CONF_MUX_CHANNELS          16
+#  define CONF_MUX_CC_1_15(CONF_CONTROL, ain) \
+	CONF_CONTROL(ain,  1, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) CONF_CONTROL(ain,  2, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL(ain,  3, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) CONF_CONTROL(ain,  4, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL(ain,  5, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) CONF_CONTROL(ain,  6, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL(ain,  7, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) CONF_CONTROL(ain,  8, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL(ain,  9, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) CONF_CONTROL(ain, 10, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL(ain, 11, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) CONF_CONTROL(ain, 12, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL(ain, 13, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) CONF_CONTROL(ain, 14, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) \
+	CONF_CONTROL(ain, 15, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR)
+#  define CONF_CONTROLS(CONF_CONTROL) \
+	CONF_CONTROL(12, 0, CTRL_TYPE_PITCHBEND, CONF_FILTER_PITCHBEND, CURVE_LINEAR) CONF_MUX_CC_1_15(CONF_CONTROL, 12) \
+	CONF_CONTROL(13, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) CONF_MUX_CC_1_15(CONF_CONTROL, 13) \
+	CONF_CONTROL(14, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) CONF_MUX_CC_1_15(CONF_CONTROL, 14) \
+	CONF_CONTROL(15, 0, CTRL_TYPE_CC, CONF_FILTER_CC, CURVE_LINEAR) CONF_MUX_CC_1_15(CONF_CONTROL, 15)
+#  define CONF_SCAN_FIRST_AIN        12
+#  define CONF_SCAN_LAST_AIN         15
+#else
+#  error "CONF_BOARD_KNOBS must be 8, 16, 20 or 64"
+#endif
+
+// external analog multiplexers (74HC4051 8:1, 74HC4067 16:1) in front of
+// the AIN pins.  the frame then holds CONF_MUX_CHANNELS passes of the pin
+// scan, one per mux address.  the address lines go to consecutive pins
+// from CONF_MUX_ADDR_PIN0 on, all in the same byte of one port, and a DMA
+// channel moves them on to the next address as soon as the last input of
+// a pass has been sampled, so the mux settles while that conversion runs.
+// 1 means no multiplexers
+#ifndef CONF_MUX_CHANNELS
+#  define CONF_MUX_CHANNELS          1
+#endif
+#define CONF_MUX_ADDR_PIN0           PIN_PA16
+
+// REF max voltage is VDDANA-.6, AREFA is pin 20
+#ifndef CONF_ADC_REFERENCE
+#  define CONF_ADC_REFERENCE         ADC_REFERENCE_AREFA
+#  define CONF_ADC_GAIN              ADC_GAIN_FACTOR_1X
+#endif
+
+// how often every control gets sampled.  the scan scheduler converts
+// each input of the pin scan once per period, for every mux channel.  if
+// that's more than the ADC can do the rate gets lowered, scan_sched_stats
+// has the rate it runs at and the fastest one possible
+#define CONF_SCAN_RATE_HZ            1000
+
+// the ADC runs off GCLK0 (48MHz), keep the ADC clock below 2.1MHz
+#define CONF_ADC_CLOCK_PRESCALER     32
+// 0-63 ... the sampling time in half ADC clocks, it sets the input impedance
+#define CONF_ADC_SAMPLE_LENGTH       3
+// samples accumulated (and averaged) by the ADC per result, as a power of 2
+#define CONF_ADC_ACCUMULATE_LOG2     2
+
+// motion adaptive oversampling on top of the ADC accumulation, the
+// FILTER_OVERSAMPLE() stage.  a control at rest averages up to
+// 2^CONF_OVERSAMPLE_MAX_DEPTH frames (the old fixed 128 samples with 4x
+// accumulation), one that moves more than CONF_OVERSAMPLE_MOTION_THRESHOLD
+// raw counts from its average goes back to single frames.  every
+// CONF_OVERSAMPLE_SETTLE_FRAMES quiet frames it averages twice as deep again
+#define CONF_OVERSAMPLE_MAX_DEPTH          5
+#define CONF_OVERSAMPLE_MOTION_THRESHOLD   24
+#define CONF_OVERSAMPLE_SETTLE_FRAMES      8
+
+// ratiometric mode for pots fed from the USB bus power: their supply,
+// divided down, goes to CONF_RATIO_REF_AIN (an unused pin inside the scan)
+// and reads CONF_RATIO_REF_NOMINAL at the nominal voltage.  every reading
+// gets normalized against it, averaged over 2^CONF_RATIO_REF_SMOOTH_LOG2
+// frames.  the ripple then no longer needs to hide in the hysteresis guard
+#define CONF_RATIOMETRIC                   false
+#define CONF_RATIO_REF_AIN                 6
+#define CONF_RATIO_REF_NOMINAL             2048
+#define CONF_RATIO_REF_SMOOTH_LOG2         2
+
+// hysteresis guard per control from its measured noise: CONF_AUTO_GUARD_MULT
+// times the mean absolute deviation of the unfiltered readings at rest
+// (which is about 0.8 sigma), kept
+// between CONF_AUTO_GUARD_MIN and CONF_AUTO_GUARD_MAX raw counts.  the noise
+// estimate averages over ~2^CONF_AUTO_GUARD_TRACK_LOG2 frames and starts
+// out at what gives a guard of CONF_AUTO_GUARD_START.  it only takes frames
+// after the control stayed within CONF_AUTO_GUARD_MOTION_MIN counts for
+// CONF_AUTO_GUARD_REST_FRAMES
+#define CONF_AUTO_GUARD                    true
+#define CONF_AUTO_GUARD_MULT               4
+#define CONF_AUTO_GUARD_MIN                1
+#define CONF_AUTO_GUARD_MAX                48
+#define CONF_AUTO_GUARD_START              8
+#define CONF_AUTO_GUARD_TRACK_LOG2         8
+#define CONF_AUTO_GUARD_MOTION_MIN         16
+#define CONF_AUTO_GUARD_REST_FRAMES        64
+
+// self calibration.  an end point gets learned once a control comes within
+// CONF_CALIB_EDGE raw counts of the end of the ADC range.  a pitchbend wheel
+// that rests within CONF_CALIB_REST_NOISE counts for CONF_CALIB_REST_FRAMES
+// frames, no more than CONF_CALIB_CENTER_RANGE from the middle, sets the
+// center.  changes go to flash CONF_CALIB_SAVE_DELAY_FRAMES frames after the
+// last one, if something moved more than CONF_CALIB_SAVE_MARGIN counts
+#define CONF_CALIB_EDGE                    256
+#define CONF_CALIB_REST_NOISE              4
+#define CONF_CALIB_REST_FRAMES             500
+#define CONF_CALIB_CENTER_RANGE            64
+#define CONF_CALIB_SAVE_DELAY_FRAMES       10000
+#define CONF_CALIB_SAVE_MARGIN             8
+
+// block filtering with the CMSIS-DSP library instead of the filter
+// pipelines in the control table, see block_filter.h.  0 is off,
+// BLOCK_FILTER_BIQUAD a second order low pass at CONF_BLOCK_FILTER_CUTOFF_HZ
+// and BLOCK_FILTER_FIR a moving average over CONF_BLOCK_FILTER_TAPS frames.
+// the controls get updated once every CONF_BLOCK_FILTER_LEN frames
+#define CONF_BLOCK_FILTER                  0
+#define CONF_BLOCK_FILTER_LEN              8
+#define CONF_BLOCK_FILTER_CUTOFF_HZ        20
+#define CONF_BLOCK_FILTER_TAPS             16
+
+// pitchbend transfer, see pitchbend.h.  values less than
+// CONF_PITCHBEND_DEADBAND from the center read as the center.  the curve
+// is 0 for a straight line up to 100 for a cubic that is flat around the
+// center
+#define CONF_PITCHBEND_DEADBAND            100
+#define CONF_PITCHBEND_CURVE               0
+
+// only wake the main loop for frames where some control left the window
+// around its current value, as checked by the ADC window monitor.  the
+// oversampling then only sees the frames that moved.  a quiet frame still
+// gets handed out every CONF_SCAN_WAKE_MAX_FRAMES, for what goes by time
+// (the rest position, saving the calibration)
+#define CONF_SCAN_WINDOW_WAKE              false
+#define CONF_SCAN_WAKE_MAX_FRAMES          100
+
+#endif // CONF_CONTROLS_H_INCLUDED
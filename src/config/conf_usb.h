@@ -81,6 +81,10 @@
 
 #define USB_DEVICE_MAX_EP 8
 
+//! Received MIDI events are waiting, see udi_midi_rx_get()
+#define  UDI_MIDI_RX_NOTIFY()             midi_rx_notify()
+extern void midi_rx_notify(void);
+
 //! The includes of classes and other headers must be done at the end of this file to avoid compile error
 #include "midi/device/udi_midi_conf.h"
 
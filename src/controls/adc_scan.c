@@ -0,0 +1,365 @@
+#include <asf.h>
+#include "controls/adc_scan.h"
+#include "controls/scan_sched.h"
+#include "controls/timebase.h"
+
+// DMAC channel that moves the ADC results
+#define ADC_SCAN_DMA_CHANNEL   0
+// DMAC channel that loads the window of the next slot
+#define ADC_SCAN_WINDOW_DMA_CHANNEL   1
+// DMAC channel that steps the external mux address
+#define ADC_SCAN_MUX_DMA_CHANNEL   2
+#define ADC_SCAN_DMA_CHANNELS  3
+
+// a frame is DMAed in blocks.  a scan that fits one pin scan wraps around
+// by itself pass after pass, so the frame is one block.  otherwise every
+// segment of every pass is a block of its own
+#if ADC_SCAN_N_SEGMENTS > 1
+#  define ADC_SCAN_BLOCKS      (ADC_SCAN_N_SEGMENTS * ADC_SCAN_N_PASSES)
+#  define ADC_SCAN_BLOCK_LEN(b)   ADC_SCAN_SEGMENT_LEN((b) % ADC_SCAN_N_SEGMENTS)
+#else
+#  define ADC_SCAN_BLOCKS      1
+#  define ADC_SCAN_BLOCK_LEN(b)   ADC_SCAN_FRAME_LEN
+#endif
+
+// the DMAC fetches descriptors from SRAM: the base section holds the first
+// descriptor of each channel, the write-back section its running state.
+// both must be 128-bit aligned
+COMPILER_ALIGNED(16) static DmacDescriptor dma_descriptor[ADC_SCAN_DMA_CHANNELS];
+COMPILER_ALIGNED(16) static DmacDescriptor dma_writeback[ADC_SCAN_DMA_CHANNELS];
+// the rest of the frame 0 / frame 1 ring of blocks, it links back to the
+// base descriptor
+COMPILER_ALIGNED(16) static DmacDescriptor dma_descriptor_ring[2*ADC_SCAN_BLOCKS-1];
+
+#if CONF_SCAN_WINDOW_WAKE
+// one descriptor per slot after the first, the chain loops around
+COMPILER_ALIGNED(16) static DmacDescriptor window_descriptor[ADC_SCAN_FRAME_LEN-1];
+// WINLT and WINUT as the DMA writes them, row j holds the window of slot j+1
+// because it gets loaded when slot j finishes converting
+static uint32_t window_seq[ADC_SCAN_FRAME_LEN][2];
+// the same windows for the software check, inclusive, offset removed
+static int16_t window_low[ADC_SCAN_FRAME_LEN];
+static int16_t window_high[ADC_SCAN_FRAME_LEN];
+static volatile bool adc_scan_force_publish = false;
+// quiet frames since the last one handed out
+static uint16_t adc_scan_quiet_run = 0;
+
+volatile uint32_t adc_scan_quiet_frames = 0;
+#endif
+
+#if ADC_SCAN_N_PASSES > 1
+#define MUX_ADDR_GROUP   (CONF_MUX_ADDR_PIN0 / 32)
+#define MUX_ADDR_SHIFT   (CONF_MUX_ADDR_PIN0 % 32)
+#define MUX_ADDR_BITS    ((ADC_SCAN_N_PASSES > 8) ? 4 : (ADC_SCAN_N_PASSES > 4) ? 3 : (ADC_SCAN_N_PASSES > 2) ? 2 : 1)
+_Static_assert((MUX_ADDR_SHIFT % 8) + MUX_ADDR_BITS <= 8, "mux address pins must sit in one port byte");
+_Static_assert(ADC_SCAN_N_PASSES <= 16, "at most 16:1 multiplexers");
+
+// the bits to flip in the address byte at each slot, entry j moves the
+// address on to the one of slot j
+static uint8_t mux_toggle[ADC_SCAN_FRAME_LEN];
+#endif
+
+static uint16_t adc_scan_frames[2][ADC_SCAN_FRAME_LEN];
+
+// frame the DMA is currently filling, the other one is the complete one
+static volatile uint8_t adc_scan_active_frame = 0;
+// block the DMA is currently filling
+static volatile uint8_t adc_scan_block = 0;
+static volatile bool adc_scan_frame_ready = false;
+// when the frame waiting to be picked up / the one handed out last started
+// sampling
+static volatile uint32_t adc_scan_ready_stamp = 0;
+static uint32_t adc_scan_stamp = 0;
+
+volatile uint32_t adc_scan_frame_count = 0;
+volatile uint32_t adc_scan_dma_errors = 0;
+
+
+static void
+setup_descriptor(DmacDescriptor *desc, uint16_t *slots, uint16_t n_slots, DmacDescriptor *next)
+{
+	desc->BTCTRL.reg = DMAC_BTCTRL_VALID |
+		DMAC_BTCTRL_BLOCKACT_INT |
+		DMAC_BTCTRL_BEATSIZE_HWORD |
+		DMAC_BTCTRL_DSTINC;
+	desc->BTCNT.reg = n_slots;
+	desc->SRCADDR.reg = (uint32_t)&ADC->RESULT.reg;
+	// with address increment the DMAC wants the end of the block
+	desc->DSTADDR.reg = (uint32_t)(slots + n_slots);
+	desc->DESCADDR.reg = (uint32_t)next;
+}
+
+
+// point the pin scan at a segment, with the offset back on its first input
+static void
+select_segment(uint8_t segment)
+{
+	uint8_t first = segment * ADC_SCAN_SEGMENT_MAX;
+
+	while (ADC->STATUS.reg & ADC_STATUS_SYNCBUSY);
+	ADC->INPUTCTRL.reg = (ADC->INPUTCTRL.reg &
+			~(ADC_INPUTCTRL_MUXPOS_Msk | ADC_INPUTCTRL_INPUTSCAN_Msk | ADC_INPUTCTRL_INPUTOFFSET_Msk)) |
+		ADC_INPUTCTRL_MUXPOS(CONF_SCAN_FIRST_AIN + first) |
+		ADC_INPUTCTRL_INPUTSCAN(ADC_SCAN_SEGMENT_LEN(segment) - 1);
+}
+
+
+#if ADC_SCAN_N_PASSES > 1
+// the scan scheduler's compare match fires once per slot, just after the
+// running conversion has taken its last sample.  each time the DMA XORs the
+// next entry of mux_toggle into the address pins, which is zero except
+// where the next slot starts a new pass.  the mux then settles while that
+// last conversion of the pass finishes
+static void
+setup_mux_dma(void)
+{
+	PortGroup *port = &PORT->Group[MUX_ADDR_GROUP];
+	uint8_t shift = MUX_ADDR_SHIFT % 8;
+
+	for (uint16_t j = 0; j < ADC_SCAN_FRAME_LEN; j++) {
+		uint8_t pass = j / ADC_SCAN_N_INPUTS;
+		uint8_t prev = ((j + ADC_SCAN_FRAME_LEN - 1) % ADC_SCAN_FRAME_LEN) / ADC_SCAN_N_INPUTS;
+		mux_toggle[j] = (uint8_t)((pass ^ prev) << shift);
+	}
+
+	// the address starts on the last pass, the first toggle gets it to 0
+	// before the first conversion
+	struct port_config pin_conf;
+	port_get_config_defaults(&pin_conf);
+	pin_conf.direction = PORT_PIN_DIR_OUTPUT;
+	for (uint8_t b = 0; b < MUX_ADDR_BITS; b++) {
+		port_pin_set_config(CONF_MUX_ADDR_PIN0 + b, &pin_conf);
+		port_pin_set_output_level(CONF_MUX_ADDR_PIN0 + b, ((ADC_SCAN_N_PASSES - 1) >> b) & 1);
+	}
+
+	DmacDescriptor *desc = &dma_descriptor[ADC_SCAN_MUX_DMA_CHANNEL];
+	desc->BTCTRL.reg = DMAC_BTCTRL_VALID |
+		DMAC_BTCTRL_BEATSIZE_BYTE |
+		DMAC_BTCTRL_SRCINC;
+	desc->BTCNT.reg = ADC_SCAN_FRAME_LEN;
+	desc->SRCADDR.reg = (uint32_t)(mux_toggle + ADC_SCAN_FRAME_LEN);
+	// PORT registers take byte writes, OUTTGL leaves the other pins alone
+	desc->DSTADDR.reg = (uint32_t)&port->OUTTGL.reg + MUX_ADDR_SHIFT / 8;
+	desc->DESCADDR.reg = (uint32_t)desc;
+
+	DMAC->CHID.reg = DMAC_CHID_ID(ADC_SCAN_MUX_DMA_CHANNEL);
+	DMAC->CHCTRLA.reg = DMAC_CHCTRLA_SWRST;
+	while (DMAC->CHCTRLA.reg & DMAC_CHCTRLA_SWRST);
+	DMAC->CHCTRLB.reg = DMAC_CHCTRLB_LVL_LVL0 |
+		DMAC_CHCTRLB_TRIGSRC(SCAN_SCHED_DMAC_ID_SAMPLED) |
+		DMAC_CHCTRLB_TRIGACT_BEAT;
+}
+#endif
+
+
+#if CONF_SCAN_WINDOW_WAKE
+static void
+setup_window_dma(void)
+{
+	for (uint16_t slot = 0; slot < ADC_SCAN_FRAME_LEN; slot++) {
+		adc_scan_set_window(slot, 0, 4095);
+	}
+
+	for (uint16_t j = 0; j < ADC_SCAN_FRAME_LEN; j++) {
+		DmacDescriptor *desc = (j == 0) ? &dma_descriptor[ADC_SCAN_WINDOW_DMA_CHANNEL] : &window_descriptor[j-1];
+		DmacDescriptor *next = (j+1 == ADC_SCAN_FRAME_LEN) ? &dma_descriptor[ADC_SCAN_WINDOW_DMA_CHANNEL] : &window_descriptor[j];
+		// WINLT (0x1c) and WINUT (0x20) are a word apart
+		desc->BTCTRL.reg = DMAC_BTCTRL_VALID |
+			DMAC_BTCTRL_BEATSIZE_WORD |
+			DMAC_BTCTRL_SRCINC |
+			DMAC_BTCTRL_DSTINC;
+		desc->BTCNT.reg = 2;
+		desc->SRCADDR.reg = (uint32_t)(window_seq[j] + 2);
+		desc->DSTADDR.reg = (uint32_t)&ADC->WINUT.reg + 4;
+		desc->DESCADDR.reg = (uint32_t)next;
+	}
+
+	// runs off the same RESRDY as the result channel, a whole block
+	// (both thresholds) per trigger
+	DMAC->CHID.reg = DMAC_CHID_ID(ADC_SCAN_WINDOW_DMA_CHANNEL);
+	DMAC->CHCTRLA.reg = DMAC_CHCTRLA_SWRST;
+	while (DMAC->CHCTRLA.reg & DMAC_CHCTRLA_SWRST);
+	DMAC->CHCTRLB.reg = DMAC_CHCTRLB_LVL_LVL0 |
+		DMAC_CHCTRLB_TRIGSRC(ADC_DMAC_ID_RESRDY) |
+		DMAC_CHCTRLB_TRIGACT_BLOCK;
+}
+
+
+// the ADC runs with an offset correction of -1 so a result is never 0,
+// a WINLT of 0 then means no lower limit and a WINUT of 4096 no upper one.
+// the hardware flags a result r when r <= WINLT or r >= WINUT
+void
+adc_scan_set_window(uint16_t slot, int16_t low, int16_t high)
+{
+	int32_t lt = (int32_t)low + ADC_SCAN_RESULT_OFFSET - 1;
+	int32_t ut = (int32_t)high + ADC_SCAN_RESULT_OFFSET + 1;
+	uint16_t row = (slot + ADC_SCAN_FRAME_LEN - 1) % ADC_SCAN_FRAME_LEN;
+
+	window_low[slot] = low;
+	window_high[slot] = high;
+	window_seq[row][0] = (uint32_t)((lt < 0) ? 0 : (lt > 4096) ? 4096 : lt);
+	window_seq[row][1] = (uint32_t)((ut < 0) ? 0 : (ut > 4096) ? 4096 : ut);
+}
+
+
+bool
+adc_scan_outside_window(uint16_t slot, uint16_t value)
+{
+	return ((int16_t)value < window_low[slot]) || ((int16_t)value > window_high[slot]);
+}
+
+
+void
+adc_scan_wake(void)
+{
+	adc_scan_force_publish = true;
+}
+#endif
+
+
+void
+adc_scan_init(void)
+{
+	system_ahb_clock_set_mask(PM_AHBMASK_DMAC);
+	system_apb_clock_set_mask(SYSTEM_CLOCK_APB_APBB, PM_APBBMASK_DMAC);
+
+	DMAC->CTRL.reg &= ~DMAC_CTRL_DMAENABLE;
+	DMAC->CTRL.reg = DMAC_CTRL_SWRST;
+	while (DMAC->CTRL.reg & DMAC_CTRL_SWRST);
+
+	DMAC->BASEADDR.reg = (uint32_t)dma_descriptor;
+	DMAC->WRBADDR.reg = (uint32_t)dma_writeback;
+
+	// frame 0 -> frame 1 -> frame 0 ... the channel never stops
+	uint16_t *slots = adc_scan_frames[0];
+	for (uint8_t j = 0; j < 2*ADC_SCAN_BLOCKS; j++) {
+		DmacDescriptor *desc = (j == 0) ? &dma_descriptor[ADC_SCAN_DMA_CHANNEL] : &dma_descriptor_ring[j-1];
+		DmacDescriptor *next = (j+1 == 2*ADC_SCAN_BLOCKS) ? &dma_descriptor[ADC_SCAN_DMA_CHANNEL] : &dma_descriptor_ring[j];
+		setup_descriptor(desc, slots, ADC_SCAN_BLOCK_LEN(j % ADC_SCAN_BLOCKS), next);
+		slots += ADC_SCAN_BLOCK_LEN(j % ADC_SCAN_BLOCKS);
+	}
+
+	DMAC->CHID.reg = DMAC_CHID_ID(ADC_SCAN_DMA_CHANNEL);
+	DMAC->CHCTRLA.reg = DMAC_CHCTRLA_SWRST;
+	while (DMAC->CHCTRLA.reg & DMAC_CHCTRLA_SWRST);
+	// one beat (one result) per RESRDY
+	DMAC->CHCTRLB.reg = DMAC_CHCTRLB_LVL_LVL0 |
+		DMAC_CHCTRLB_TRIGSRC(ADC_DMAC_ID_RESRDY) |
+		DMAC_CHCTRLB_TRIGACT_BEAT;
+	DMAC->CHINTENSET.reg = DMAC_CHINTENSET_TCMPL | DMAC_CHINTENSET_TERR;
+
+#if CONF_SCAN_WINDOW_WAKE
+	setup_window_dma();
+#endif
+#if ADC_SCAN_N_PASSES > 1
+	setup_mux_dma();
+#endif
+
+	DMAC->CTRL.reg = DMAC_CTRL_DMAENABLE | DMAC_CTRL_LVLEN(0xf);
+	system_interrupt_enable(SYSTEM_INTERRUPT_MODULE_DMA);
+}
+
+
+// the ADC must already be configured, the pin scan setup happens here.
+// conversions get started by the scan scheduler
+void
+adc_scan_start(struct adc_module *const module_inst)
+{
+	adc_scan_active_frame = 0;
+	adc_scan_block = 0;
+	adc_scan_frame_ready = false;
+
+	DMAC->CHID.reg = DMAC_CHID_ID(ADC_SCAN_DMA_CHANNEL);
+	DMAC->CHCTRLA.reg = DMAC_CHCTRLA_ENABLE;
+
+#if CONF_SCAN_WINDOW_WAKE
+	// slot 0's window goes in by hand, the DMA loads the rest.  the first
+	// frame gets through even if nothing left its window
+	adc_set_window_mode(module_inst, ADC_WINDOW_MODE_BETWEEN_INVERTED,
+		(int16_t)window_seq[ADC_SCAN_FRAME_LEN-1][0], (int16_t)window_seq[ADC_SCAN_FRAME_LEN-1][1]);
+	adc_scan_force_publish = true;
+	ADC->INTFLAG.reg = ADC_INTFLAG_WINMON;
+	DMAC->CHID.reg = DMAC_CHID_ID(ADC_SCAN_WINDOW_DMA_CHANNEL);
+	DMAC->CHCTRLA.reg = DMAC_CHCTRLA_ENABLE;
+#endif
+#if ADC_SCAN_N_PASSES > 1
+	DMAC->CHID.reg = DMAC_CHID_ID(ADC_SCAN_MUX_DMA_CHANNEL);
+	DMAC->CHCTRLA.reg = DMAC_CHCTRLA_ENABLE;
+#endif
+
+	// restart the scan at its first input so frame slots line up with pins
+	select_segment(0);
+}
+
+
+const uint16_t *
+adc_scan_get_frame(void)
+{
+	if (!adc_scan_frame_ready) {
+		return NULL;
+	}
+	adc_scan_frame_ready = false;
+	adc_scan_stamp = adc_scan_ready_stamp;
+	return adc_scan_frames[adc_scan_active_frame ^ 1];
+}
+
+
+uint32_t
+adc_scan_frame_stamp(void)
+{
+	return adc_scan_stamp;
+}
+
+
+const uint16_t *
+adc_scan_wait_frame(void)
+{
+	const uint16_t *frame;
+	while ((frame = adc_scan_get_frame()) == NULL) {
+		// the DMA completion interrupt wakes us back up
+		sleepmgr_sleep(SLEEPMGR_IDLE_0);
+	}
+	return frame;
+}
+
+
+void
+DMAC_Handler(void)
+{
+	DMAC->CHID.reg = DMAC_CHID_ID(ADC_SCAN_DMA_CHANNEL);
+	uint8_t flags = DMAC->CHINTFLAG.reg;
+	DMAC->CHINTFLAG.reg = flags;
+
+	if (flags & DMAC_CHINTFLAG_TERR) {
+		adc_scan_dma_errors++;
+	}
+	if (flags & DMAC_CHINTFLAG_TCMPL) {
+#if ADC_SCAN_BLOCKS > 1
+		// a segment is done, the pin scan moves on before the next trigger
+		adc_scan_block = (adc_scan_block + 1) % ADC_SCAN_BLOCKS;
+		select_segment(adc_scan_block % ADC_SCAN_N_SEGMENTS);
+		if (adc_scan_block != 0) {
+			return;
+		}
+#endif
+		scan_sched_frame_done(adc_scan_frame_ready);
+		// the block that just finished is the frame we were filling
+		adc_scan_active_frame ^= 1;
+		adc_scan_frame_count++;
+#if CONF_SCAN_WINDOW_WAKE
+		// WINMON sticks until cleared, so it tells if any slot of the
+		// frame left its window.  if none did there's nothing to wake for
+		bool moved = (ADC->INTFLAG.reg & ADC_INTFLAG_WINMON) != 0;
+		ADC->INTFLAG.reg = ADC_INTFLAG_WINMON;
+		if (!moved && !adc_scan_force_publish && ++adc_scan_quiet_run < CONF_SCAN_WAKE_MAX_FRAMES) {
+			adc_scan_quiet_frames++;
+			return;
+		}
+		adc_scan_force_publish = false;
+		adc_scan_quiet_run = 0;
+#endif
+		// slot 0 got sampled about a frame period ago
+		adc_scan_ready_stamp = timebase_now() - scan_sched_stats.period_nominal;
+		adc_scan_frame_ready = true;
+	}
+}
@@ -0,0 +1,70 @@
+#ifndef _ADC_SCAN_H_
+#define _ADC_SCAN_H_
+
+#include <asf.h>
+#include "conf_controls.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// a frame holds one result for every AIN pin from CONF_SCAN_FIRST_AIN to
+// CONF_SCAN_LAST_AIN.  the ADC pin scan covers at most 16 consecutive
+// inputs, longer scans are split up in segments
+#define ADC_SCAN_N_INPUTS      (CONF_SCAN_LAST_AIN - CONF_SCAN_FIRST_AIN + 1)
+#define ADC_SCAN_SEGMENT_MAX   16
+#define ADC_SCAN_N_SEGMENTS    ((ADC_SCAN_N_INPUTS + ADC_SCAN_SEGMENT_MAX - 1) / ADC_SCAN_SEGMENT_MAX)
+#define ADC_SCAN_SEGMENT_LEN(s) \
+	(((s) + 1 < ADC_SCAN_N_SEGMENTS) ? ADC_SCAN_SEGMENT_MAX : ADC_SCAN_N_INPUTS - (s) * ADC_SCAN_SEGMENT_MAX)
+
+// with external multiplexers the pin scan runs once per mux address, pass
+// p holds mux channel p of every pin
+#define ADC_SCAN_N_PASSES      (CONF_MUX_CHANNELS)
+#define ADC_SCAN_FRAME_LEN     (ADC_SCAN_N_INPUTS * ADC_SCAN_N_PASSES)
+// where the result of an AIN pin / mux channel lands in the frame
+#define ADC_SCAN_SLOT(ain, mux)   ((mux) * ADC_SCAN_N_INPUTS + (ain) - CONF_SCAN_FIRST_AIN)
+
+// what the ADC adds to every result, take it off before using a sample
+#if CONF_SCAN_WINDOW_WAKE
+#  define ADC_SCAN_RESULT_OFFSET   1
+#else
+#  define ADC_SCAN_RESULT_OFFSET   0
+#endif
+
+// the acquisition engine runs the ADC pin scan over the frame's AIN pins
+// and has the DMAC move every RESRDY result into one of two frames.
+// one interrupt fires per complete frame (and one per segment in between),
+// the cpu never touches the ADC while it's sampling
+void adc_scan_init(void);
+void adc_scan_start(struct adc_module *const module_inst);
+
+// returns the newest complete frame or NULL if none arrived since the
+// last call.  the frame stays valid until the DMA finishes the next one
+const uint16_t * adc_scan_get_frame(void);
+// sleeps until a new frame is available
+const uint16_t * adc_scan_wait_frame(void);
+// timebase stamp (see timebase.h) of when the frame handed out last
+// started sampling
+uint32_t adc_scan_frame_stamp(void);
+
+#if CONF_SCAN_WINDOW_WAKE
+// window wake: the ADC window monitor checks every result against the
+// window of its slot (a second DMA channel reloads WINLT/WINUT between
+// conversions) and frames where no slot left its window are never handed
+// out.  low/high are inclusive and without the result offset
+void adc_scan_set_window(uint16_t slot, int16_t low, int16_t high);
+bool adc_scan_outside_window(uint16_t slot, uint16_t value);
+// the next frame gets handed out even if nothing moved, so the main loop
+// wakes up for something else
+void adc_scan_wake(void);
+
+extern volatile uint32_t adc_scan_quiet_frames;
+#endif
+
+extern volatile uint32_t adc_scan_frame_count;
+extern volatile uint32_t adc_scan_dma_errors;
+
+#ifdef __cplusplus
+}
+#endif
+#endif // _ADC_SCAN_H_
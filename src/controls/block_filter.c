@@ -0,0 +1,137 @@
+#include <asf.h>
+#include <arm_math.h>
+#include "controls/block_filter.h"
+#include "controls/adc_scan.h"
+#include "controls/filter.h"
+#include "controls/ratiometric.h"
+#include "controls/timebase.h"
+
+#if CONF_BLOCK_FILTER
+
+#if CONF_BLOCK_FILTER == BLOCK_FILTER_BIQUAD
+// the biquad runs in q31.  in q15 the output gets truncated on every
+// sample and the feedback adds that up, at a cutoff of 1/50 of the scan
+// rate it settled 8 counts low
+typedef q31_t sample_t;
+#define SAMPLE_SHIFT   19
+
+// one stage: b0, b1, b2, a1, a2 at half scale, postShift puts it back
+static q31_t coeffs[5];
+static q31_t state[N_CTRLS][4];
+static arm_biquad_casd_df1_inst_q31 inst[N_CTRLS];
+
+
+// RBJ low pass with Q = 1/sqrt(2).  the b coefficients get rounded so
+// they add up to exactly what the a ones leave, that keeps the gain at DC
+// at exactly 1
+static void
+biquad_coeffs(uint32_t rate_hz)
+{
+	float32_t w0 = 2.0f * PI * CONF_BLOCK_FILTER_CUTOFF_HZ / rate_hz;
+	float32_t cw = arm_cos_f32(w0);
+	float32_t alpha = arm_sin_f32(w0) * 0.70710678f;
+	float32_t a0 = 1.0f + alpha;
+	int32_t a1 = (int32_t)(2.0f * cw / a0 * 1073741824.0f + 0.5f);
+	int32_t a2 = -(int32_t)((1.0f - alpha) / a0 * 1073741824.0f + 0.5f);
+	int32_t b = 1073741824 - a1 - a2;
+
+	coeffs[0] = (b + 2) / 4;
+	coeffs[1] = b - 2 * coeffs[0];
+	coeffs[2] = coeffs[0];
+	coeffs[3] = a1;
+	coeffs[4] = a2;
+}
+#else
+typedef q15_t sample_t;
+#define SAMPLE_SHIFT   3
+
+static q15_t coeffs[CONF_BLOCK_FILTER_TAPS];
+static q15_t state[N_CTRLS][CONF_BLOCK_FILTER_TAPS + CONF_BLOCK_FILTER_LEN - 1];
+static arm_fir_instance_q15 inst[N_CTRLS];
+#endif
+
+// 12 bit samples as fractions
+#define TO_SAMPLE(x)   ((sample_t)((int32_t)(x) << SAMPLE_SHIFT))
+
+static const uint16_t ctrl_slot[N_CTRLS] = CONTROL_MAP_SLOTS;
+
+static sample_t block_in[N_CTRLS][CONF_BLOCK_FILTER_LEN];
+static sample_t block_out[CONF_BLOCK_FILTER_LEN];
+static uint16_t block_value[N_CTRLS];
+static uint8_t block_pos = 0;
+
+
+static inline uint16_t
+from_sample(sample_t x)
+{
+	int32_t v = ((int32_t)x + (1 << (SAMPLE_SHIFT - 1))) >> SAMPLE_SHIFT;
+	return (v < 0) ? 0 : (v > 4095) ? 4095 : (uint16_t)v;
+}
+
+
+void
+block_filter_init(uint32_t rate_hz, const uint16_t *frame)
+{
+	for (uint8_t i = 0; i < N_CTRLS; i++) {
+		uint16_t v = ratio_apply(frame[ctrl_slot[i]] - ADC_SCAN_RESULT_OFFSET);
+		block_value[i] = v;
+#if CONF_BLOCK_FILTER == BLOCK_FILTER_BIQUAD
+		if (i == 0) {
+			biquad_coeffs(rate_hz);
+		}
+		arm_biquad_cascade_df1_init_q31(&inst[i], 1, coeffs, state[i], 1);
+		// x[n-1], x[n-2], y[n-1], y[n-2] as if it always sat there
+		for (uint8_t k = 0; k < 4; k++) {
+			state[i][k] = TO_SAMPLE(v);
+		}
+#else
+		// the taps add up to exactly 1.0
+		if (i == 0) {
+			for (uint8_t k = 0; k < CONF_BLOCK_FILTER_TAPS; k++) {
+				coeffs[k] = (q15_t)(32768 / CONF_BLOCK_FILTER_TAPS + (k < 32768 % CONF_BLOCK_FILTER_TAPS));
+			}
+		}
+		arm_fir_init_q15(&inst[i], CONF_BLOCK_FILTER_TAPS, coeffs, state[i], CONF_BLOCK_FILTER_LEN);
+		for (uint8_t k = 0; k < CONF_BLOCK_FILTER_TAPS - 1; k++) {
+			state[i][k] = TO_SAMPLE(v);
+		}
+#endif
+	}
+	block_pos = 0;
+}
+
+
+bool
+block_filter_add(const uint16_t *frame)
+{
+	uint32_t start = timebase_now();
+
+	for (uint8_t i = 0; i < N_CTRLS; i++) {
+		block_in[i][block_pos] = TO_SAMPLE(ratio_apply(frame[ctrl_slot[i]] - ADC_SCAN_RESULT_OFFSET));
+	}
+	if (++block_pos < CONF_BLOCK_FILTER_LEN) {
+		filter_cycles_add(timebase_elapsed(start, timebase_now()));
+		return false;
+	}
+	block_pos = 0;
+
+	for (uint8_t i = 0; i < N_CTRLS; i++) {
+#if CONF_BLOCK_FILTER == BLOCK_FILTER_BIQUAD
+		arm_biquad_cascade_df1_q31(&inst[i], block_in[i], block_out, CONF_BLOCK_FILTER_LEN);
+#else
+		arm_fir_q15(&inst[i], block_in[i], block_out, CONF_BLOCK_FILTER_LEN);
+#endif
+		block_value[i] = from_sample(block_out[CONF_BLOCK_FILTER_LEN - 1]);
+	}
+	filter_cycles_add(timebase_elapsed(start, timebase_now()));
+	return true;
+}
+
+
+uint16_t
+block_filter_value(uint8_t i)
+{
+	return block_value[i];
+}
+
+#endif
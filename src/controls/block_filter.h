@@ -0,0 +1,42 @@
+#ifndef _BLOCK_FILTER_H_
+#define _BLOCK_FILTER_H_
+
+#include <asf.h>
+#include "conf_controls.h"
+#include "controls/control_map.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// block filtering with the CMSIS-DSP routines.  instead of running
+// every control's filter pipeline on every frame the samples get collected
+// for CONF_BLOCK_FILTER_LEN frames and then filtered a whole block per
+// control in one call.  the controls then only get looked at once per
+// block, with the newest filtered value
+
+#define BLOCK_FILTER_NONE     0
+// second order low pass at CONF_BLOCK_FILTER_CUTOFF_HZ,
+// arm_biquad_cascade_df1_q31()
+#define BLOCK_FILTER_BIQUAD   1
+// moving average over CONF_BLOCK_FILTER_TAPS frames, arm_fir_q15()
+#define BLOCK_FILTER_FIR      2
+
+#if CONF_BLOCK_FILTER
+_Static_assert(!CONF_SCAN_WINDOW_WAKE, "the block filter needs every frame");
+_Static_assert(CONF_BLOCK_FILTER != BLOCK_FILTER_FIR ||
+	(CONF_BLOCK_FILTER_TAPS >= 4 && CONF_BLOCK_FILTER_TAPS % 2 == 0),
+	"arm_fir_q15() takes an even number of taps, 4 or more");
+
+// every filter starts out at the control's value in frame
+void block_filter_init(uint32_t rate_hz, const uint16_t *frame);
+// adds a frame, returns true when that completed a block
+bool block_filter_add(const uint16_t *frame);
+// the newest filtered value of control i
+uint16_t block_filter_value(uint8_t i);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+#endif // _BLOCK_FILTER_H_
@@ -0,0 +1,293 @@
+#include <asf.h>
+#include "controls/calibration.h"
+#include "controls/adc_scan.h"
+
+#define CALIB_MAGIC      0x314c4143   // "CAL1"
+#define CALIB_ROW_SIZE   (NVMCTRL_ROW_PAGES * FLASH_PAGE_SIZE)
+
+typedef struct {
+	uint32_t magic;
+	uint16_t count;
+	uint16_t checksum;
+	calib_range_t range[N_CTRLS];
+} calib_store_t;
+
+#define CALIB_FLASH_ROWS   ((sizeof(calib_store_t) + CALIB_ROW_SIZE - 1) / CALIB_ROW_SIZE)
+#define CALIB_FLASH_WORDS  (CALIB_FLASH_ROWS * CALIB_ROW_SIZE / 4)
+
+typedef union {
+	calib_store_t store;
+	uint32_t words[CALIB_FLASH_WORDS];
+} calib_image_t;
+
+// whole erased rows of their own in the program flash.  volatile so the
+// compiler doesn't fold the reads into the 0xff it got initialized with
+static const volatile calib_image_t calib_flash
+	__attribute__((section(".rodata.calib"), aligned(CALIB_ROW_SIZE))) = {
+	.words = { [0 ... CALIB_FLASH_WORDS-1] = 0xffffffff }
+};
+
+static const uint8_t calib_type[N_CTRLS] = CONTROL_MAP_TYPES;
+
+calib_range_t calib_ranges[N_CTRLS];
+calib_corr_t calib_table[N_CTRLS];
+
+// what's in flash right now
+static calib_range_t calib_saved[N_CTRLS];
+static bool calib_changed = false;
+// times are in scanned frames (adc_scan_frame_count), with window wake the
+// main loop doesn't get to see the quiet ones
+static uint32_t calib_changed_frame = 0;
+
+// rest position tracking: where the control last was, since when, and
+// whether that got looked at already
+static uint16_t rest_value[N_CTRLS];
+static uint32_t rest_since[N_CTRLS];
+static bool rest_checked[N_CTRLS];
+
+
+static uint16_t
+calib_checksum(const calib_store_t *store)
+{
+	const uint16_t *p = (const uint16_t *)store->range;
+	uint16_t sum = store->count;
+
+	for (uint16_t j = 0; j < N_CTRLS * (sizeof(calib_range_t) / sizeof(uint16_t)); j++) {
+		sum += p[j];
+	}
+	return (uint16_t)~sum;
+}
+
+
+// works out the correction from the learned range.  an end point only
+// counts once the control got near that end, until then the full ADC
+// range is assumed.  the gains round up so the end points land exactly
+// on 0 and out_max
+static void
+calib_update(uint8_t i)
+{
+	const calib_range_t *r = &calib_ranges[i];
+	calib_corr_t *c = &calib_table[i];
+	uint32_t lo = 0, hi = 4095, center;
+
+	if (r->min <= r->max) {
+		if (r->min <= CONF_CALIB_EDGE) {
+			lo = r->min;
+		}
+		if (r->max >= 4095 - CONF_CALIB_EDGE) {
+			hi = r->max;
+		}
+	}
+	center = (lo + hi + 1) / 2;
+	if (calib_type[i] == CTRL_TYPE_PITCHBEND) {
+		c->out_max = 16383;
+		if (r->center != CALIB_NO_CENTER && r->center > lo && r->center < hi) {
+			center = r->center;
+		}
+	} else {
+		c->out_max = 4095;
+	}
+	c->out_center = (c->out_max + 1) / 2;
+	c->center = (uint16_t)center;
+
+	c->gain_lo = (((uint32_t)c->out_center << 16) + (center - lo) - 1) / (center - lo);
+	c->gain_hi = (((uint32_t)(c->out_max - c->out_center) << 16) + (hi - center) - 1) / (hi - center);
+	c->inv_lo = ((center - lo) << 16) / c->out_center;
+	c->inv_hi = ((hi - center) << 16) / (c->out_max - c->out_center);
+}
+
+
+static void
+calib_mark_changed(uint8_t i)
+{
+	calib_update(i);
+	calib_changed = true;
+	calib_changed_frame = adc_scan_frame_count;
+}
+
+
+void
+calib_extend(uint8_t i, uint16_t raw)
+{
+	calib_range_t *r = &calib_ranges[i];
+
+	if (r->min > r->max) {
+		r->min = r->max = raw;
+	} else if (raw < r->min) {
+		r->min = raw;
+	} else {
+		r->max = raw;
+	}
+	calib_mark_changed(i);
+}
+
+
+// notes where the control is, calib_poll() checks if it stays there
+void
+calib_track_center(uint8_t i, uint16_t raw)
+{
+	int d = (int)raw - (int)rest_value[i];
+
+	if (d > CONF_CALIB_REST_NOISE || d < -CONF_CALIB_REST_NOISE) {
+		rest_value[i] = raw;
+		rest_since[i] = adc_scan_frame_count;
+		rest_checked[i] = false;
+	}
+}
+
+
+// a control that sat still near the middle for CONF_CALIB_REST_FRAMES has
+// come back to its rest position.  with window wake it isn't looked at
+// while it sits still, so this goes by the frames that got scanned
+static void
+calib_check_rest(uint8_t i)
+{
+	uint16_t raw = rest_value[i];
+	int d = (int)raw - 2048;
+
+	if (rest_checked[i] || adc_scan_frame_count - rest_since[i] < CONF_CALIB_REST_FRAMES) {
+		return;
+	}
+	rest_checked[i] = true;
+	if (d > CONF_CALIB_CENTER_RANGE || d < -CONF_CALIB_CENTER_RANGE || raw == calib_ranges[i].center) {
+		return;
+	}
+	calib_ranges[i].center = raw;
+	calib_mark_changed(i);
+}
+
+
+uint16_t
+calib_unapply(uint8_t i, uint16_t out)
+{
+	const calib_corr_t *c = &calib_table[i];
+
+	// everything beyond the learned end points reads as the end point
+	if (out == 0) {
+		return 0;
+	}
+	if (out >= c->out_max) {
+		return 4095;
+	}
+	if (out >= c->out_center) {
+		return (uint16_t)(c->center + (((uint32_t)(out - c->out_center) * c->inv_hi) >> 16));
+	}
+	return (uint16_t)(c->center - (((uint32_t)(c->out_center - out) * c->inv_lo) >> 16));
+}
+
+
+void
+calib_init(void)
+{
+	static calib_image_t image;
+
+	for (uint16_t w = 0; w < CALIB_FLASH_WORDS; w++) {
+		image.words[w] = calib_flash.words[w];
+	}
+
+	bool valid = image.store.magic == CALIB_MAGIC &&
+		image.store.count == N_CTRLS &&
+		image.store.checksum == calib_checksum(&image.store);
+
+	for (uint8_t i = 0; i < N_CTRLS; i++) {
+		if (valid) {
+			calib_ranges[i] = image.store.range[i];
+		} else {
+			calib_ranges[i].min = 0xffff;
+			calib_ranges[i].max = 0;
+			calib_ranges[i].center = CALIB_NO_CENTER;
+		}
+		calib_saved[i] = calib_ranges[i];
+		rest_checked[i] = true;
+		calib_update(i);
+	}
+}
+
+
+static bool
+nvm_command(uint32_t cmd, uint32_t addr)
+{
+	while (!(NVMCTRL->INTFLAG.reg & NVMCTRL_INTFLAG_READY));
+	NVMCTRL->STATUS.reg = NVMCTRL_STATUS_MASK;
+	// the address is in 16 bit words
+	NVMCTRL->ADDR.reg = addr / 2;
+	NVMCTRL->CTRLA.reg = cmd | NVMCTRL_CTRLA_CMDEX_KEY;
+	while (!(NVMCTRL->INTFLAG.reg & NVMCTRL_INTFLAG_READY));
+	return !(NVMCTRL->STATUS.reg & (NVMCTRL_STATUS_PROGE | NVMCTRL_STATUS_LOCKE | NVMCTRL_STATUS_NVME));
+}
+
+
+// the cpu stalls while a row gets erased (a few ms), the DMA keeps on
+// scanning
+bool
+calib_save(void)
+{
+	static calib_image_t image;
+	uint32_t base = (uint32_t)&calib_flash;
+	bool ok = true;
+
+	for (uint16_t w = 0; w < CALIB_FLASH_WORDS; w++) {
+		image.words[w] = 0xffffffff;
+	}
+	image.store.magic = CALIB_MAGIC;
+	image.store.count = N_CTRLS;
+	for (uint8_t i = 0; i < N_CTRLS; i++) {
+		image.store.range[i] = calib_ranges[i];
+	}
+	image.store.checksum = calib_checksum(&image.store);
+
+	NVMCTRL->CTRLB.reg |= NVMCTRL_CTRLB_MANW;
+	for (uint16_t row = 0; row < CALIB_FLASH_ROWS; row++) {
+		ok = ok && nvm_command(NVMCTRL_CTRLA_CMD_ER, base + row * CALIB_ROW_SIZE);
+	}
+	for (uint16_t page = 0; ok && page < CALIB_FLASH_ROWS * NVMCTRL_ROW_PAGES; page++) {
+		uint16_t first = page * (FLASH_PAGE_SIZE / 4);
+		volatile uint32_t *dst = (volatile uint32_t *)(base + page * FLASH_PAGE_SIZE);
+
+		ok = nvm_command(NVMCTRL_CTRLA_CMD_PBC, 0);
+		for (uint16_t w = 0; w < FLASH_PAGE_SIZE / 4; w++) {
+			dst[w] = image.words[first + w];
+		}
+		ok = ok && nvm_command(NVMCTRL_CTRLA_CMD_WP, (uint32_t)dst);
+	}
+	nvm_command(NVMCTRL_CTRLA_CMD_INVALL, 0);
+
+	if (ok) {
+		for (uint8_t i = 0; i < N_CTRLS; i++) {
+			calib_saved[i] = calib_ranges[i];
+		}
+	}
+	return ok;
+}
+
+
+static bool
+differs(uint16_t a, uint16_t b)
+{
+	return (a > b) ? (a - b > CONF_CALIB_SAVE_MARGIN) : (b - a > CONF_CALIB_SAVE_MARGIN);
+}
+
+
+void
+calib_poll(void)
+{
+	for (uint8_t i = 0; i < N_CTRLS; i++) {
+		if (calib_type[i] == CTRL_TYPE_PITCHBEND) {
+			calib_check_rest(i);
+		}
+	}
+	if (!calib_changed || adc_scan_frame_count - calib_changed_frame < CONF_CALIB_SAVE_DELAY_FRAMES) {
+		return;
+	}
+	calib_changed = false;
+
+	// flash rows only take so many erases, small drifts don't get written
+	for (uint8_t i = 0; i < N_CTRLS; i++) {
+		if (differs(calib_ranges[i].min, calib_saved[i].min) ||
+				differs(calib_ranges[i].max, calib_saved[i].max) ||
+				differs(calib_ranges[i].center, calib_saved[i].center)) {
+			calib_save();
+			return;
+		}
+	}
+}
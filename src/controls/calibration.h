@@ -0,0 +1,86 @@
+#ifndef _CALIBRATION_H_
+#define _CALIBRATION_H_
+
+#include <asf.h>
+#include "conf_controls.h"
+#include "controls/control_map.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// per control self calibration.  the lowest and highest raw values a
+// control reaches and the rest position of the pitchbend wheel get learned
+// while playing and kept in a flash row, every sample then goes through a
+// fixed point correction that stretches the learned range to the full
+// 0-4095 (CC) or 0-16383 (pitchbend) output
+
+// learned range of a control in raw ADC counts.  min > max means nothing
+// learned yet, a center of CALIB_NO_CENTER means the mid point is used
+typedef struct {
+	uint16_t min;
+	uint16_t max;
+	uint16_t center;
+} calib_range_t;
+
+#define CALIB_NO_CENTER   0xffff
+
+// raw values at or above center map to out_center + (raw-center)*gain_hi/2^16,
+// the ones below it to out_center - (center-raw)*gain_lo/2^16.  the inv_*
+// gains go the other way
+typedef struct {
+	uint16_t center;
+	uint16_t out_center;
+	uint16_t out_max;
+	uint32_t gain_lo;
+	uint32_t gain_hi;
+	uint32_t inv_lo;
+	uint32_t inv_hi;
+} calib_corr_t;
+
+extern calib_range_t calib_ranges[N_CTRLS];
+extern calib_corr_t calib_table[N_CTRLS];
+
+// loads the calibration from flash and builds the correction table
+void calib_init(void);
+// call once per frame from the main loop, sets the rest position of a
+// control that stayed put long enough and writes the calibration back to
+// flash a while after it stopped changing.  with window wake the main loop
+// still has to come by every now and then, see CONF_SCAN_WAKE_MAX_FRAMES
+void calib_poll(void);
+bool calib_save(void);
+
+void calib_extend(uint8_t i, uint16_t raw);
+// learns the rest position of a spring loaded control
+void calib_track_center(uint8_t i, uint16_t raw);
+// the raw value a corrected one came from
+uint16_t calib_unapply(uint8_t i, uint16_t out);
+
+
+static inline void
+calib_learn(uint8_t i, uint16_t raw)
+{
+	if (raw < calib_ranges[i].min || raw > calib_ranges[i].max) {
+		calib_extend(i, raw);
+	}
+}
+
+
+static inline uint16_t
+calib_apply(uint8_t i, uint16_t raw)
+{
+	const calib_corr_t *c = &calib_table[i];
+	uint32_t d;
+
+	if (raw >= c->center) {
+		d = ((uint32_t)(raw - c->center) * c->gain_hi) >> 16;
+		return (d >= (uint32_t)(c->out_max - c->out_center)) ? c->out_max : (uint16_t)(c->out_center + d);
+	}
+	d = ((uint32_t)(c->center - raw) * c->gain_lo) >> 16;
+	return (d >= c->out_center) ? 0 : (uint16_t)(c->out_center - d);
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif // _CALIBRATION_H_
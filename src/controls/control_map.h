@@ -0,0 +1,76 @@
+#ifndef _CONTROL_MAP_H_
+#define _CONTROL_MAP_H_
+
+#include "conf_controls.h"
+#include "controls/adc_scan.h"
+#include "midi/device/udi_midi.h"
+
+// the control table in conf_controls.h expanded into what the scan loop
+// needs.  everything here is worked out by the compiler
+
+#define CTRL_TYPE_CC          0
+#define CTRL_TYPE_PITCHBEND   1
+// 14 bit CC, MSB and LSB controller pair
+#define CTRL_TYPE_CC14        2
+// 14 bit NRPN, the parameter number follows the control's index
+#define CTRL_TYPE_NRPN        3
+
+#define CONTROL_MAP_COUNT(ain, mux, type, filter, curve)     + 1
+#define CONTROL_MAP_SLOT(ain, mux, type, filter, curve)      ADC_SCAN_SLOT(ain, mux),
+#define CONTROL_MAP_AIN(ain, mux, type, filter, curve)       (ain),
+#define CONTROL_MAP_TYPE(ain, mux, type, filter, curve)      type,
+#define CONTROL_MAP_FILTER(ain, mux, type, filter, curve)    filter,
+#define CONTROL_MAP_CURVE(ain, mux, type, filter, curve)     curve,
+#define CONTROL_MAP_N_PITCHBEND(ain, mux, type, filter, curve)  + ((type) == CTRL_TYPE_PITCHBEND)
+
+#define N_CTRLS   (0 CONF_CONTROLS(CONTROL_MAP_COUNT))
+
+// initializers for const tables, indexed by control:
+// the frame slot the control's result lands in
+#define CONTROL_MAP_SLOTS   { CONF_CONTROLS(CONTROL_MAP_SLOT) }
+// its AIN pin
+#define CONTROL_MAP_AINS    { CONF_CONTROLS(CONTROL_MAP_AIN) }
+// CTRL_TYPE_*
+#define CONTROL_MAP_TYPES   { CONF_CONTROLS(CONTROL_MAP_TYPE) }
+// its filter stages, needs filter.h
+#define CONTROL_MAP_FILTERS { CONF_CONTROLS(CONTROL_MAP_FILTER) }
+// its response curve, needs curve.h
+#define CONTROL_MAP_CURVES  { CONF_CONTROLS(CONTROL_MAP_CURVE) }
+
+#define CONTROL_MAP_CHECK(ain, mux, type, filter, curve) \
+	_Static_assert((ain) >= CONF_SCAN_FIRST_AIN && (ain) <= CONF_SCAN_LAST_AIN, \
+		"AIN " #ain " is outside the pin scan"); \
+	_Static_assert((mux) < CONF_MUX_CHANNELS, "AIN " #ain " mux channel " #mux " out of range");
+
+CONF_CONTROLS(CONTROL_MAP_CHECK)
+
+// the index of every control, named after its slot.  a slot that's in the
+// table twice fails here
+#define CONTROL_MAP_INDEX_NAME(ain, mux)   CONTROL_MAP_INDEX_ ## ain ## _ ## mux
+#define CONTROL_MAP_INDEX(ain, mux, type, filter, curve)   CONTROL_MAP_INDEX_NAME(ain, mux),
+enum { CONF_CONTROLS(CONTROL_MAP_INDEX) };
+
+// a 14 bit CC sends control i's LSB on CC i+CTRL_CC_FIRST+32, which has to
+// be a CC below 64 and can't be the CC of plain control i+32.  the mask has
+// a bit for every 14 bit CC among the first 31 controls, the ones after
+// that fail anyway
+#define CONTROL_MAP_CC14_BIT(ain, mux, type, filter, curve) \
+	| (((type) == CTRL_TYPE_CC14 && CONTROL_MAP_INDEX_NAME(ain, mux) < 31) ? \
+		1 << (CONTROL_MAP_INDEX_NAME(ain, mux) & 31) : 0)
+enum { CONTROL_MAP_CC14_MASK = 0 CONF_CONTROLS(CONTROL_MAP_CC14_BIT) };
+
+#define CONTROL_MAP_CHECK_CC14(ain, mux, type, filter, curve) \
+	_Static_assert((type) != CTRL_TYPE_CC14 || CONTROL_MAP_INDEX_NAME(ain, mux) + CTRL_CC_FIRST < 32, \
+		"AIN " #ain " mux channel " #mux ": a 14 bit CC has to be one of the first 32 - CTRL_CC_FIRST controls"); \
+	_Static_assert((type) != CTRL_TYPE_CC || CONTROL_MAP_INDEX_NAME(ain, mux) < 32 || \
+		!((CONTROL_MAP_CC14_MASK >> ((CONTROL_MAP_INDEX_NAME(ain, mux) - 32) & 31)) & 1), \
+		"AIN " #ain " mux channel " #mux ": its CC is the LSB of a 14 bit CC");
+
+CONF_CONTROLS(CONTROL_MAP_CHECK_CC14)
+_Static_assert(CONF_SCAN_LAST_AIN <= 19, "the SAMD21J has AIN0 to AIN19");
+_Static_assert(N_CTRLS <= ADC_SCAN_FRAME_LEN, "more controls than scanned inputs");
+_Static_assert((0 CONF_CONTROLS(CONTROL_MAP_N_PITCHBEND)) <= 1, "only one pitchbend control");
+// the index goes into the midi queue in 6 bits
+_Static_assert(N_CTRLS <= 64, "at most 64 controls");
+
+#endif // _CONTROL_MAP_H_
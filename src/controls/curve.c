@@ -0,0 +1,53 @@
+#include <asf.h>
+#include "controls/curve.h"
+
+// the curves as functions of x in [0, 1] going from 0 to 1.  the log and
+// exp ones are a hyperbola and its inverse, CURVE_K sets how bent they are
+#define CURVE_K              8.0
+#define CURVE_FN_LINEAR(x)   (x)
+#define CURVE_FN_LOG(x)      ((x) * (1.0 + CURVE_K) / (1.0 + CURVE_K * (x)))
+#define CURVE_FN_EXP(x)      ((x) / (1.0 + CURVE_K * (1.0 - (x))))
+#define CURVE_FN_S(x)        ((x) * (x) * (3.0 - 2.0 * (x)))
+
+// entry n covers the raw values from n << CURVE_STEP_LOG2 on, the last one
+// is x = 1 so every curve gets to 127.  the outputs are even slices of the
+// curve, that keeps the linear one the same as raw >> 5
+#define CURVE_X(n)           ((double)(n) / (CURVE_TABLE_LEN - 1))
+#define CURVE_OUT(y)         ((uint8_t)(((y) * 128.0 < 127.0) ? (y) * 128.0 : 127.0))
+
+#define CURVE_ENTRY_LINEAR(n)   CURVE_OUT(CURVE_FN_LINEAR(CURVE_X(n))),
+#define CURVE_ENTRY_LOG(n)      CURVE_OUT(CURVE_FN_LOG(CURVE_X(n))),
+#define CURVE_ENTRY_EXP(n)      CURVE_OUT(CURVE_FN_EXP(CURVE_X(n))),
+#define CURVE_ENTRY_S(n)        CURVE_OUT(CURVE_FN_S(CURVE_X(n))),
+
+#define CURVE_REP4(M, n)      M(n) M((n)+1) M((n)+2) M((n)+3)
+#define CURVE_REP16(M, n)     CURVE_REP4(M, n) CURVE_REP4(M, (n)+4) CURVE_REP4(M, (n)+8) CURVE_REP4(M, (n)+12)
+#define CURVE_REP64(M, n)     CURVE_REP16(M, n) CURVE_REP16(M, (n)+16) CURVE_REP16(M, (n)+32) CURVE_REP16(M, (n)+48)
+#define CURVE_REP256(M, n)    CURVE_REP64(M, n) CURVE_REP64(M, (n)+64) CURVE_REP64(M, (n)+128) CURVE_REP64(M, (n)+192)
+#define CURVE_REP1024(M)      CURVE_REP256(M, 0) CURVE_REP256(M, 256) CURVE_REP256(M, 512) CURVE_REP256(M, 768)
+
+_Static_assert(CURVE_TABLE_LEN == 1024, "CURVE_REP1024 fills the tables");
+
+const uint8_t curve_tables[CURVE_N_KINDS][CURVE_TABLE_LEN] = {
+	[CURVE_LINEAR] = { CURVE_REP1024(CURVE_ENTRY_LINEAR) },
+	[CURVE_LOG] = { CURVE_REP1024(CURVE_ENTRY_LOG) },
+	[CURVE_EXP] = { CURVE_REP1024(CURVE_ENTRY_EXP) },
+	[CURVE_S] = { CURVE_REP1024(CURVE_ENTRY_S) },
+};
+
+uint16_t curve_edge[CURVE_N_KINDS][128 + 1];
+
+
+void
+curve_init(void)
+{
+	for (uint8_t c = 0; c < CURVE_N_KINDS; c++) {
+		uint16_t n = 0;
+		for (uint8_t k = 0; k <= 128; k++) {
+			while (n < CURVE_TABLE_LEN && curve_tables[c][n] < k) {
+				n++;
+			}
+			curve_edge[c][k] = n << CURVE_STEP_LOG2;
+		}
+	}
+}
@@ -0,0 +1,49 @@
+#ifndef _CURVE_H_
+#define _CURVE_H_
+
+#include <asf.h>
+#include "conf_controls.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// response curves for the 7 bit controls.  every curve is a const table
+// in flash, worked out by the compiler, that takes the calibrated 0-4095
+// value (in steps of 4) to 0-127.  the hysteresis stays on the raw side:
+// curve_edge[] holds the raw value each output starts at
+
+enum curve_kind {
+	CURVE_LINEAR = 0,
+	// fast at the start, for frequencies
+	CURVE_LOG,
+	// slow at the start, for volumes
+	CURVE_EXP,
+	// flat at both ends
+	CURVE_S,
+	CURVE_N_KINDS
+};
+
+#define CURVE_TABLE_LOG2   10
+#define CURVE_TABLE_LEN    (1 << CURVE_TABLE_LOG2)
+// the raw steps per table entry
+#define CURVE_STEP_LOG2    (12 - CURVE_TABLE_LOG2)
+
+extern const uint8_t curve_tables[CURVE_N_KINDS][CURVE_TABLE_LEN];
+// the lowest raw value that maps to output k, curve_edge[c][128] is 4096
+extern uint16_t curve_edge[CURVE_N_KINDS][128 + 1];
+
+// works out curve_edge[]
+void curve_init(void);
+
+
+static inline uint8_t
+curve_apply(uint8_t c, uint16_t raw)
+{
+	return curve_tables[c][raw >> CURVE_STEP_LOG2];
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif // _CURVE_H_
@@ -0,0 +1,233 @@
+#include <asf.h>
+#include "controls/filter.h"
+#include <string.h>
+
+// 2*pi in 16.16
+#define TWO_PI_Q16   411775u
+
+// the one euro smoothing factor w/(1+w) for w = 2*pi*cutoff*T from 0 to
+// 4 in steps of 1/16, in between it gets interpolated
+#define ALPHA_TAB_STEPS   64
+static uint16_t alpha_tab[ALPHA_TAB_STEPS + 1];
+static bool alpha_tab_done = false;
+
+volatile filter_cycle_stats_t filter_cycle_stats;
+
+
+// a * b / 2^16 with b no more than 2^16, without a 64 bit multiply
+static inline int32_t
+mul_q16(int32_t a, uint32_t b)
+{
+	uint32_t m = (a < 0) ? (uint32_t)-a : (uint32_t)a;
+	uint32_t r = (m >> 16) * b + (((m & 0xffff) * b) >> 16);
+	return (a < 0) ? -(int32_t)r : (int32_t)r;
+}
+
+
+static inline uint16_t
+from_q16(int32_t y)
+{
+	y = (y + 0x8000) >> 16;
+	return (y < 0) ? 0 : (y > 0xffff) ? 0xffff : (uint16_t)y;
+}
+
+
+// T/(tau+T), the EMA factor for a time constant of tau_ms at a frame period
+// of period_us
+static uint32_t
+ema_alpha(uint16_t tau_ms, uint32_t period_us)
+{
+	return (uint32_t)(((uint64_t)period_us << 16) / ((uint32_t)tau_ms * 1000 + period_us));
+}
+
+
+static uint16_t
+filter_ema(filter_state_t *s, uint16_t x)
+{
+	s->ema.y += mul_q16(((int32_t)x << 16) - s->ema.y, s->ema.alpha);
+	return from_q16(s->ema.y);
+}
+
+
+static uint16_t
+filter_median3(filter_state_t *s, uint16_t x)
+{
+	uint16_t a = s->median.x1, b = s->median.x2, m;
+
+	s->median.x2 = a;
+	s->median.x1 = x;
+	if (a > b) {
+		uint16_t t = a; a = b; b = t;
+	}
+	// a <= b, the median is x clamped to [a, b]
+	m = (x < a) ? a : (x > b) ? b : x;
+	return m;
+}
+
+
+static uint16_t
+filter_one_euro(filter_state_t *s, uint16_t x)
+{
+	int32_t d = ((int32_t)x << 16) - s->one_euro.y;
+	int32_t dx = ((int32_t)x - s->one_euro.x_prev) << 16;
+	uint32_t w, speed, alpha;
+	uint8_t idx;
+
+	// the input's speed in counts per frame, smoothed
+	s->one_euro.x_prev = x;
+	s->one_euro.dx += mul_q16(dx - s->one_euro.dx, s->one_euro.alpha_d);
+	speed = (s->one_euro.dx < 0) ? (uint32_t)-s->one_euro.dx : (uint32_t)s->one_euro.dx;
+
+	// the cutoff rises with the speed, w = 2*pi*cutoff*T
+	w = s->one_euro.w_min + (uint32_t)mul_q16((int32_t)speed, s->one_euro.w_per_speed);
+	if (w >= (uint32_t)ALPHA_TAB_STEPS << 12) {
+		alpha = alpha_tab[ALPHA_TAB_STEPS];
+	} else {
+		idx = (uint8_t)(w >> 12);
+		alpha = alpha_tab[idx] + (((alpha_tab[idx+1] - alpha_tab[idx]) * (w & 0xfff)) >> 12);
+	}
+
+	s->one_euro.y += mul_q16(d, alpha);
+	return from_q16(s->one_euro.y);
+}
+
+
+static uint16_t
+filter_hysteresis(filter_state_t *s, uint16_t x)
+{
+	uint16_t y = s->hysteresis.y, band = s->hysteresis.band;
+
+	if (x > y + band) {
+		y = x - band;
+	} else if (x + band < y) {
+		y = x + band;
+	}
+	s->hysteresis.y = y;
+	return y;
+}
+
+
+static uint16_t
+filter_predict(filter_state_t *s, uint16_t x)
+{
+	int32_t d = (int32_t)x - s->predict.last;
+	int32_t r, v, y;
+
+	s->predict.last = x;
+	// x and v are 16.16, v in counts per frame
+	s->predict.x += s->predict.v;
+	r = ((int32_t)x << 16) - s->predict.x;
+	s->predict.x += mul_q16(r, s->predict.alpha);
+	s->predict.v += mul_q16(r, s->predict.beta);
+
+	// the input stopped or turned, whatever lead there is would overshoot
+	if ((d <= 0 && s->predict.v > 0) || (d >= 0 && s->predict.v < 0)) {
+		s->predict.v = 0;
+		s->predict.x = (int32_t)x << 16;
+		return x;
+	}
+	// an EMA in front keeps creeping on for a while after the control
+	// stopped, with ever smaller steps.  what's left of its way is about
+	// the last step times its delay, so the lead never goes faster than the
+	// input does right now
+	v = s->predict.v;
+	if ((v > 0 && v > (d << 16)) || (v < 0 && v < (d << 16))) {
+		v = d << 16;
+	}
+	// the tracked position swings past the input when a sweep ends, the
+	// lead goes on top of the input itself.  it is more than a frame, this
+	// needs the long multiply
+	y = ((int32_t)x << 16) + (int32_t)(((int64_t)v * s->predict.lead) >> 16);
+	return from_q16(y);
+}
+
+
+static uint16_t
+filter_oversample(filter_state_t *s, uint16_t x)
+{
+	return oversample_update(&s->oversample, x);
+}
+
+
+static const filter_fn_t filter_fns[FILTER_N_KINDS] = {
+	[FILTER_KIND_EMA] = filter_ema,
+	[FILTER_KIND_MEDIAN3] = filter_median3,
+	[FILTER_KIND_ONE_EURO] = filter_one_euro,
+	[FILTER_KIND_HYSTERESIS] = filter_hysteresis,
+	[FILTER_KIND_OVERSAMPLE] = filter_oversample,
+	[FILTER_KIND_PREDICT] = filter_predict,
+};
+
+
+void
+filter_cycles_add(uint32_t cycles)
+{
+	filter_cycle_stats.frames++;
+	filter_cycle_stats.cycles_last = cycles;
+	if (cycles > filter_cycle_stats.cycles_max) {
+		filter_cycle_stats.cycles_max = cycles;
+	}
+	if (filter_cycle_stats.cycles_avg == 0) {
+		filter_cycle_stats.cycles_avg = cycles;
+	}
+	filter_cycle_stats.cycles_avg += (int32_t)(cycles - filter_cycle_stats.cycles_avg) >> 4;
+}
+
+
+void
+filter_init(filter_t *f, const filter_stage_t *conf, uint32_t rate_hz, uint16_t x)
+{
+	uint32_t period_us = 1000000UL / rate_hz;
+
+	if (!alpha_tab_done) {
+		for (uint8_t j = 0; j <= ALPHA_TAB_STEPS; j++) {
+			alpha_tab[j] = (uint16_t)(((uint32_t)j << 16) / (16 + j));
+		}
+		alpha_tab_done = true;
+	}
+
+	memset(f, 0, sizeof(*f));
+	for (uint8_t k = 0; k < FILTER_MAX_STAGES && conf[k].kind != FILTER_KIND_NONE; k++) {
+		filter_state_t *s = &f->state[k];
+
+		switch (conf[k].kind) {
+		case FILTER_KIND_EMA:
+			s->ema.y = (int32_t)x << 16;
+			s->ema.alpha = ema_alpha(conf[k].a, period_us);
+			break;
+		case FILTER_KIND_MEDIAN3:
+			s->median.x1 = s->median.x2 = x;
+			break;
+		case FILTER_KIND_ONE_EURO:
+			s->one_euro.y = (int32_t)x << 16;
+			s->one_euro.x_prev = x;
+			s->one_euro.alpha_d = ema_alpha(conf[k].c, period_us);
+			// 2*pi*T/tau at rest, and 2*pi*beta per count/frame on top
+			s->one_euro.w_min = (uint32_t)(((uint64_t)TWO_PI_Q16 * period_us) / ((uint32_t)conf[k].a * 1000 + 1));
+			s->one_euro.w_per_speed = (uint32_t)(((uint64_t)TWO_PI_Q16 * conf[k].b) / 1000);
+			if (s->one_euro.w_per_speed > 0xffff) {
+				s->one_euro.w_per_speed = 0xffff;
+			}
+			break;
+		case FILTER_KIND_HYSTERESIS:
+			s->hysteresis.y = x;
+			s->hysteresis.band = conf[k].a;
+			break;
+		case FILTER_KIND_PREDICT:
+			s->predict.x = (int32_t)x << 16;
+			s->predict.last = x;
+			// critically damped: beta = alpha^2 / (2 - alpha)
+			s->predict.alpha = ema_alpha(conf[k].b, period_us);
+			s->predict.beta = (uint32_t)(((uint64_t)s->predict.alpha * s->predict.alpha) /
+				((2UL << 16) - s->predict.alpha));
+			s->predict.lead = (uint32_t)(((uint64_t)conf[k].a * 1000 << 16) / period_us);
+			break;
+		default:
+			break;
+		}
+		f->fn[k] = filter_fns[conf[k].kind];
+		f->n_stages = k + 1;
+	}
+	// run the start value through once so every stage has seen it
+	filter_run(f, x);
+}
@@ -0,0 +1,131 @@
+#ifndef _FILTER_H_
+#define _FILTER_H_
+
+#include <asf.h>
+#include "conf_controls.h"
+#include "controls/oversample.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// per control filter pipeline.  the stages of a control are given in
+// conf_controls.h with their parameters in milliseconds, filter_init()
+// works out the per frame coefficients for the actual scan rate and fills
+// in a function per stage.  the hot loop then just calls them in order
+
+#define FILTER_MAX_STAGES   3
+
+enum filter_kind {
+	FILTER_KIND_NONE = 0,
+	FILTER_KIND_EMA,
+	FILTER_KIND_MEDIAN3,
+	FILTER_KIND_ONE_EURO,
+	FILTER_KIND_HYSTERESIS,
+	FILTER_KIND_OVERSAMPLE,
+	FILTER_KIND_PREDICT,
+	FILTER_N_KINDS
+};
+
+typedef struct {
+	uint8_t kind;
+	uint16_t a, b, c;
+} filter_stage_t;
+
+// exponential moving average with a time constant of tau_ms
+#define FILTER_EMA(tau_ms)          { FILTER_KIND_EMA, (tau_ms), 0, 0 }
+// median of the last three frames, takes out single frame spikes
+#define FILTER_MEDIAN3()            { FILTER_KIND_MEDIAN3, 0, 0, 0 }
+// one euro filter: a time constant of tau_ms at rest that gets shorter
+// the faster the control moves, the cutoff rises by beta_mhz mHz per raw
+// count per second (159 at most).  the speed is smoothed with a time
+// constant of dtau_ms
+#define FILTER_ONE_EURO(tau_ms, beta_mhz, dtau_ms) \
+	{ FILTER_KIND_ONE_EURO, (tau_ms), (beta_mhz), (dtau_ms) }
+// the output only follows once the input is more than band counts away
+#define FILTER_HYSTERESIS(band)     { FILTER_KIND_HYSTERESIS, (band), 0, 0 }
+// motion adaptive oversampling, see oversample.h
+#define FILTER_OVERSAMPLE()         { FILTER_KIND_OVERSAMPLE, 0, 0, 0 }
+// alpha-beta tracker that puts back the lag of the stages before it: the
+// speed gets estimated with a time constant of tau_ms and the output runs
+// lead_ms ahead along it.  the lead is dropped as soon as the input stops
+// going that way, so the output doesn't overshoot where a sweep ends.
+// lead_ms is about the delay of the stages before it, an EMA delays by
+// its tau
+#define FILTER_PREDICT(lead_ms, tau_ms) { FILTER_KIND_PREDICT, (lead_ms), (tau_ms), 0 }
+
+// values in the EMA and one euro stages are 16.16 fixed point
+typedef union {
+	struct {
+		int32_t y;
+		uint32_t alpha;
+	} ema;
+	struct {
+		uint16_t x1, x2;
+	} median;
+	struct {
+		int32_t y;
+		// the input's speed, smoothed, and the input of the frame before
+		int32_t dx;
+		uint16_t x_prev;
+		uint32_t alpha_d;
+		uint32_t w_min;
+		uint32_t w_per_speed;
+	} one_euro;
+	struct {
+		uint16_t y;
+		uint16_t band;
+	} hysteresis;
+	struct {
+		int32_t x;
+		int32_t v;
+		uint32_t alpha;
+		uint32_t beta;
+		// lead in frames, 16.16
+		uint32_t lead;
+		uint16_t last;
+	} predict;
+	oversample_t oversample;
+} filter_state_t;
+
+typedef uint16_t (*filter_fn_t)(filter_state_t *state, uint16_t x);
+
+typedef struct {
+	filter_fn_t fn[FILTER_MAX_STAGES];
+	filter_state_t state[FILTER_MAX_STAGES];
+	uint8_t n_stages;
+} filter_t;
+
+// cpu cycles the filtering of one frame took, over all controls, to
+// compare the filter pipelines with the block filter (see block_filter.h,
+// its blocks show up in cycles_max).  cycles_avg is a running average over
+// about 16 frames
+typedef struct {
+	uint32_t frames;
+	uint32_t cycles_last;
+	uint32_t cycles_avg;
+	uint32_t cycles_max;
+} filter_cycle_stats_t;
+
+extern volatile filter_cycle_stats_t filter_cycle_stats;
+
+void filter_cycles_add(uint32_t cycles);
+
+// stages are taken from conf up to the first FILTER_KIND_NONE, x is the
+// value the filter starts out at
+void filter_init(filter_t *f, const filter_stage_t *conf, uint32_t rate_hz, uint16_t x);
+
+
+static inline uint16_t
+filter_run(filter_t *f, uint16_t x)
+{
+	for (uint8_t k = 0; k < f->n_stages; k++) {
+		x = f->fn[k](&f->state[k], x);
+	}
+	return x;
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif // _FILTER_H_
@@ -0,0 +1,55 @@
+#include <asf.h>
+#include "controls/noise_guard.h"
+
+#define NOISE_GUARD_MAD_FRAC    12
+
+
+static uint8_t
+guard_from_mad(int32_t mad)
+{
+	int32_t guard = (mad * CONF_AUTO_GUARD_MULT + (1L << NOISE_GUARD_MAD_FRAC) - 1) >> NOISE_GUARD_MAD_FRAC;
+
+	if (guard < CONF_AUTO_GUARD_MIN) {
+		return CONF_AUTO_GUARD_MIN;
+	}
+	if (guard > CONF_AUTO_GUARD_MAX) {
+		return CONF_AUTO_GUARD_MAX;
+	}
+	return (uint8_t)guard;
+}
+
+
+uint8_t
+noise_guard_update(noise_guard_t *ng, uint16_t raw, uint16_t value)
+{
+	if (!ng->primed) {
+		// start out with the noise the fixed guard was made for
+		ng->anchor = value;
+		ng->last = raw;
+		ng->still = 0;
+		ng->mad = ((int32_t)CONF_AUTO_GUARD_START << NOISE_GUARD_MAD_FRAC) / CONF_AUTO_GUARD_MULT;
+		ng->guard = guard_from_mad(ng->mad);
+		ng->primed = true;
+		return ng->guard;
+	}
+
+	int32_t away = (value > ng->anchor) ? value - ng->anchor : ng->anchor - value;
+	int32_t step = (raw > ng->last) ? raw - ng->last : ng->last - raw;
+
+	ng->last = raw;
+	if (away > CONF_AUTO_GUARD_MOTION_MIN) {
+		ng->anchor = value;
+		ng->still = 0;
+		return ng->guard;
+	}
+	if (ng->still < CONF_AUTO_GUARD_REST_FRAMES) {
+		ng->still++;
+		return ng->guard;
+	}
+	// the difference of two frames has sqrt(2) times the noise of one,
+	// 181/256 takes that back out
+	int32_t dev = (step * 181) << (NOISE_GUARD_MAD_FRAC - 8);
+	ng->mad += (dev - ng->mad) >> CONF_AUTO_GUARD_TRACK_LOG2;
+	ng->guard = guard_from_mad(ng->mad);
+	return ng->guard;
+}
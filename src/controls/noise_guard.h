@@ -0,0 +1,38 @@
+#ifndef _NOISE_GUARD_H_
+#define _NOISE_GUARD_H_
+
+#include <asf.h>
+#include "conf_controls.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// per control hysteresis guard, sized from the noise the control shows
+// while it rests.  a control rests once its filtered value stayed within
+// CONF_AUTO_GUARD_MOTION_MIN counts of one spot for CONF_AUTO_GUARD_REST_FRAMES
+// frames, only then the frame to frame differences of the unfiltered
+// value go into the noise estimate.  the filter takes most of the noise out
+// of its own frame to frame differences, what's left of it is the slow
+// wander the guard has to cover.  the rest test doesn't depend on the
+// estimate, so moving the control can't talk it up
+typedef struct {
+	// where the control came to rest, for how many frames, and the last
+	// unfiltered value
+	uint16_t anchor;
+	uint16_t still;
+	uint16_t last;
+	// mean absolute deviation, scaled by 2^NOISE_GUARD_MAD_FRAC
+	int32_t mad;
+	// guard band in raw counts
+	uint8_t guard;
+	bool primed;
+} noise_guard_t;
+
+// raw is the reading before the filter, value what the filter made of it
+uint8_t noise_guard_update(noise_guard_t *ng, uint16_t raw, uint16_t value);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // _NOISE_GUARD_H_
@@ -0,0 +1,38 @@
+#include <asf.h>
+#include "controls/oversample.h"
+
+
+uint16_t
+oversample_update(oversample_t *os, uint16_t raw)
+{
+	if (!os->primed) {
+		os->acc = raw;
+		os->depth = 0;
+		os->settled = 0;
+		os->primed = true;
+		return raw;
+	}
+
+	uint16_t avg = (uint16_t)(os->acc >> os->depth);
+	int diff = (int)raw - (int)avg;
+
+	if (diff > CONF_OVERSAMPLE_MOTION_THRESHOLD || diff < -CONF_OVERSAMPLE_MOTION_THRESHOLD) {
+		// moving: follow the raw frames with no averaging at all
+		os->acc = raw;
+		os->depth = 0;
+		os->settled = 0;
+		return raw;
+	}
+
+	// exponential average over ~2^depth frames
+	os->acc += raw;
+	os->acc -= avg;
+
+	if (os->depth < CONF_OVERSAMPLE_MAX_DEPTH &&
+			++os->settled >= CONF_OVERSAMPLE_SETTLE_FRAMES) {
+		os->acc <<= 1;
+		os->depth++;
+		os->settled = 0;
+	}
+	return (uint16_t)(os->acc >> os->depth);
+}
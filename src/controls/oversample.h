@@ -0,0 +1,28 @@
+#ifndef _OVERSAMPLE_H_
+#define _OVERSAMPLE_H_
+
+#include <asf.h>
+#include "conf_controls.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// motion adaptive oversampling, one per control.  a control at rest
+// averages the last ~2^depth frames, as soon as it moves it drops back
+// to single frames and then works its way deeper again once it settles
+typedef struct {
+	// running average, scaled by 2^depth
+	uint32_t acc;
+	uint8_t depth;
+	// frames without motion since the last depth change
+	uint8_t settled;
+	bool primed;
+} oversample_t;
+
+uint16_t oversample_update(oversample_t *os, uint16_t raw);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // _OVERSAMPLE_H_
@@ -0,0 +1,62 @@
+#include <asf.h>
+#include "controls/pitchbend.h"
+
+#define PITCHBEND_CENTER        8192
+#define PITCHBEND_MAX           16383
+
+// the curve blends a cubic into the straight line, CONF_PITCHBEND_CURVE
+// percent of it, which leaves the ends where they are and makes the wheel
+// finer around the center.  d*d/range*d/range is the cubic without
+// leaving 32 bits
+#if CONF_PITCHBEND_CURVE
+#define PITCHBEND_D(x)          ((int32_t)(x) - PITCHBEND_CENTER)
+#define PITCHBEND_RANGE(x)      (((x) < PITCHBEND_CENTER) ? PITCHBEND_CENTER : PITCHBEND_MAX - PITCHBEND_CENTER)
+#define PITCHBEND_CURVED(x)     (PITCHBEND_CENTER + PITCHBEND_D(x) - CONF_PITCHBEND_CURVE * \
+	(PITCHBEND_D(x) - PITCHBEND_D(x) * PITCHBEND_D(x) / PITCHBEND_RANGE(x) * PITCHBEND_D(x) / PITCHBEND_RANGE(x)) / 100)
+#else
+#define PITCHBEND_CURVED(x)     (x)
+#endif
+
+// deadband in the center
+#define PITCHBEND_ENTRY(x) \
+	((PITCHBEND_CURVED(x) > PITCHBEND_CENTER - CONF_PITCHBEND_DEADBAND && \
+	  PITCHBEND_CURVED(x) < PITCHBEND_CENTER + CONF_PITCHBEND_DEADBAND) ? PITCHBEND_CENTER : PITCHBEND_CURVED(x)),
+
+// the entries a hex digit at a time, 0x0000 to 0x3fff
+#define PITCHBEND_16(p) \
+	PITCHBEND_ENTRY(p##0) PITCHBEND_ENTRY(p##1) PITCHBEND_ENTRY(p##2) PITCHBEND_ENTRY(p##3) \
+	PITCHBEND_ENTRY(p##4) PITCHBEND_ENTRY(p##5) PITCHBEND_ENTRY(p##6) PITCHBEND_ENTRY(p##7) \
+	PITCHBEND_ENTRY(p##8) PITCHBEND_ENTRY(p##9) PITCHBEND_ENTRY(p##a) PITCHBEND_ENTRY(p##b) \
+	PITCHBEND_ENTRY(p##c) PITCHBEND_ENTRY(p##d) PITCHBEND_ENTRY(p##e) PITCHBEND_ENTRY(p##f)
+#define PITCHBEND_256(p) \
+	PITCHBEND_16(p##0) PITCHBEND_16(p##1) PITCHBEND_16(p##2) PITCHBEND_16(p##3) \
+	PITCHBEND_16(p##4) PITCHBEND_16(p##5) PITCHBEND_16(p##6) PITCHBEND_16(p##7) \
+	PITCHBEND_16(p##8) PITCHBEND_16(p##9) PITCHBEND_16(p##a) PITCHBEND_16(p##b) \
+	PITCHBEND_16(p##c) PITCHBEND_16(p##d) PITCHBEND_16(p##e) PITCHBEND_16(p##f)
+#define PITCHBEND_4096(p) \
+	PITCHBEND_256(p##0) PITCHBEND_256(p##1) PITCHBEND_256(p##2) PITCHBEND_256(p##3) \
+	PITCHBEND_256(p##4) PITCHBEND_256(p##5) PITCHBEND_256(p##6) PITCHBEND_256(p##7) \
+	PITCHBEND_256(p##8) PITCHBEND_256(p##9) PITCHBEND_256(p##a) PITCHBEND_256(p##b) \
+	PITCHBEND_256(p##c) PITCHBEND_256(p##d) PITCHBEND_256(p##e) PITCHBEND_256(p##f)
+
+const uint16_t pitchbend_table[PITCHBEND_TABLE_LEN] = {
+	PITCHBEND_4096(0x0) PITCHBEND_4096(0x1) PITCHBEND_4096(0x2) PITCHBEND_4096(0x3)
+};
+
+
+// the transfer only goes up, binary search it
+uint16_t
+pitchbend_unapply(uint8_t i, uint16_t out)
+{
+	uint16_t lo = 0, hi = 4096;
+
+	while (lo < hi) {
+		uint16_t mid = (lo + hi) / 2;
+		if (pitchbend_lookup(i, mid) < out) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
@@ -0,0 +1,37 @@
+#ifndef _PITCHBEND_H_
+#define _PITCHBEND_H_
+
+#include <asf.h>
+#include "conf_controls.h"
+#include "controls/control_map.h"
+#include "controls/calibration.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// the pitchbend transfer function.  the calibration stretches the raw
+// reading to 0-16383 with the rest position on 8192, a table over that
+// value then holds the curve and the center deadband.  the preprocessor
+// builds the table from CONF_PITCHBEND_CURVE and CONF_PITCHBEND_DEADBAND
+// and it stays in flash, a new calibration takes effect right away
+
+#define PITCHBEND_TABLE_LEN   16384
+
+extern const uint16_t pitchbend_table[PITCHBEND_TABLE_LEN];
+
+// the lowest raw value of control i that maps to out or above, 4096 if
+// none does
+uint16_t pitchbend_unapply(uint8_t i, uint16_t out);
+
+
+static inline uint16_t
+pitchbend_lookup(uint8_t i, uint16_t raw)
+{
+	return pitchbend_table[calib_apply(i, raw)];
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif // _PITCHBEND_H_
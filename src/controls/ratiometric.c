@@ -0,0 +1,49 @@
+#include <asf.h>
+#include "controls/ratiometric.h"
+#include "controls/adc_scan.h"
+
+uint32_t ratio_scale = 1UL << 16;
+uint32_t ratio_inv_scale = 1UL << 16;
+
+#if CONF_RATIOMETRIC
+// the reference reading, averaged over 2^CONF_RATIO_REF_SMOOTH_LOG2 frames
+// and scaled by that much
+static uint32_t ref_acc = 0;
+#endif
+
+
+void
+ratio_init(void)
+{
+#if CONF_RATIOMETRIC
+	uint32_t ref_ain = CONF_RATIO_REF_AIN;
+
+	adc_regular_ain_channel(&ref_ain, 1);
+	ref_acc = (uint32_t)CONF_RATIO_REF_NOMINAL << CONF_RATIO_REF_SMOOTH_LOG2;
+#endif
+	ratio_scale = 1UL << 16;
+	ratio_inv_scale = 1UL << 16;
+}
+
+
+// two divisions per frame, the per sample work is a multiply
+void
+ratio_update(const uint16_t *frame)
+{
+#if CONF_RATIOMETRIC
+	uint32_t ref = frame[RATIO_REF_SLOT] - ADC_SCAN_RESULT_OFFSET;
+
+	ref_acc -= ref_acc >> CONF_RATIO_REF_SMOOTH_LOG2;
+	ref_acc += ref;
+	ref = ref_acc >> CONF_RATIO_REF_SMOOTH_LOG2;
+	// a reference that makes no sense (not fitted, shorted) scales by no
+	// more than 2
+	if (ref < CONF_RATIO_REF_NOMINAL / 2) {
+		ref = CONF_RATIO_REF_NOMINAL / 2;
+	}
+	ratio_scale = ((uint32_t)CONF_RATIO_REF_NOMINAL << 16) / ref;
+	ratio_inv_scale = (ref << 16) / CONF_RATIO_REF_NOMINAL;
+#else
+	UNUSED(frame);
+#endif
+}
@@ -0,0 +1,62 @@
+#ifndef _RATIOMETRIC_H_
+#define _RATIOMETRIC_H_
+
+#include <asf.h>
+#include "conf_controls.h"
+#include "controls/control_map.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// ratiometric mode: the supply the pots hang off gets sampled in every
+// frame (through a divider, on CONF_RATIO_REF_AIN) and every reading is
+// scaled by CONF_RATIO_REF_NOMINAL / that sample.  ripple and drift on the
+// USB bus power then cancel out instead of showing up as control motion
+
+#if CONF_RATIOMETRIC
+#define RATIO_REF_SLOT   ADC_SCAN_SLOT(CONF_RATIO_REF_AIN, 0)
+
+#define RATIO_CHECK_REF(ain, mux, type, filter, curve)   + ((ain) == CONF_RATIO_REF_AIN)
+_Static_assert(CONF_RATIO_REF_AIN >= CONF_SCAN_FIRST_AIN && CONF_RATIO_REF_AIN <= CONF_SCAN_LAST_AIN,
+	"the reference AIN has to be in the pin scan");
+_Static_assert((0 CONF_CONTROLS(RATIO_CHECK_REF)) == 0, "the reference AIN is wired to a control");
+#endif
+
+// both 16.16 fixed point, scale takes a reading to the nominal supply and
+// inv_scale back again
+extern uint32_t ratio_scale;
+extern uint32_t ratio_inv_scale;
+
+void ratio_init(void);
+// picks up the reference of a new frame
+void ratio_update(const uint16_t *frame);
+
+
+static inline uint16_t
+ratio_apply(uint16_t raw)
+{
+#if CONF_RATIOMETRIC
+	uint32_t v = ((uint32_t)raw * ratio_scale) >> 16;
+	return (v > 4095) ? 4095 : (uint16_t)v;
+#else
+	return raw;
+#endif
+}
+
+
+static inline uint16_t
+ratio_unapply(uint16_t v)
+{
+#if CONF_RATIOMETRIC
+	uint32_t raw = ((uint32_t)v * ratio_inv_scale) >> 16;
+	return (raw > 4095) ? 4095 : (uint16_t)raw;
+#else
+	return v;
+#endif
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif // _RATIOMETRIC_H_
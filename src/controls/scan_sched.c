@@ -0,0 +1,125 @@
+#include <asf.h>
+#include "controls/scan_sched.h"
+#include "controls/timebase.h"
+#include <string.h>
+
+#define SCAN_SCHED_TC          TC3
+#define SCAN_SCHED_EVSYS_CH    0
+
+volatile scan_sched_stats_t scan_sched_stats;
+
+static uint32_t slot_cycles = 0;
+static uint32_t last_frame_stamp = 0;
+static bool have_last_frame = false;
+
+static const uint16_t tc_prescalers[] = { 1, 2, 4, 8, 16, 64, 256, 1024 };
+
+
+void
+scan_sched_init(uint16_t rate_hz, uint16_t n_slots)
+{
+	uint32_t cpu_hz = system_gclk_gen_get_hz(GCLK_GENERATOR_0);
+	uint8_t presc;
+
+	timebase_init();
+
+	memset((void *)&scan_sched_stats, 0, sizeof(scan_sched_stats));
+	slot_cycles = cpu_hz / ((uint32_t)rate_hz * n_slots);
+	if (slot_cycles < SCAN_SCHED_SLOT_MIN_CYCLES) {
+		// the ADC can't keep up, stretch the slot rather than lose triggers
+		slot_cycles = SCAN_SCHED_SLOT_MIN_CYCLES;
+		scan_sched_stats.rate_clamped = true;
+	}
+	scan_sched_stats.period_nominal = slot_cycles * n_slots;
+	scan_sched_stats.period_min = 0xffffffff;
+	scan_sched_stats.slots = n_slots;
+	scan_sched_stats.rate_hz = cpu_hz / scan_sched_stats.period_nominal;
+	scan_sched_stats.max_rate_hz = cpu_hz / (SCAN_SCHED_SLOT_MIN_CYCLES * n_slots);
+
+	// smallest prescaler that gets the slot into 16 bits
+	for (presc = 0; presc < sizeof(tc_prescalers)/sizeof(tc_prescalers[0]) - 1; presc++) {
+		if (slot_cycles / tc_prescalers[presc] <= 0x10000) {
+			break;
+		}
+	}
+
+	system_apb_clock_set_mask(SYSTEM_CLOCK_APB_APBC, PM_APBCMASK_TC3 | PM_APBCMASK_EVSYS);
+
+	struct system_gclk_chan_config gclk_chan_conf;
+	system_gclk_chan_get_config_defaults(&gclk_chan_conf);
+	gclk_chan_conf.source_generator = GCLK_GENERATOR_0;
+	system_gclk_chan_set_config(TC3_GCLK_ID, &gclk_chan_conf);
+	system_gclk_chan_enable(TC3_GCLK_ID);
+
+	TcCount16 *tc = &SCAN_SCHED_TC->COUNT16;
+	tc->CTRLA.reg = TC_CTRLA_SWRST;
+	while (tc->CTRLA.reg & TC_CTRLA_SWRST);
+
+	tc->CTRLA.reg = TC_CTRLA_MODE_COUNT16 |
+		TC_CTRLA_WAVEGEN_MFRQ |
+		TC_CTRLA_PRESCALER(presc) |
+		TC_CTRLA_PRESCSYNC_PRESC;
+	tc->CC[0].reg = (uint16_t)(slot_cycles / tc_prescalers[presc] - 1);
+	// the overflow starts a conversion, the compare match marks it sampled.
+	// a stretched slot leaves the extra time for whatever switches inputs
+	tc->CC[1].reg = (uint16_t)((SCAN_SCHED_SLOT_SAMPLED_CYCLES + tc_prescalers[presc] - 1) / tc_prescalers[presc]);
+	tc->EVCTRL.reg = TC_EVCTRL_OVFEO;
+	while (tc->STATUS.reg & TC_STATUS_SYNCBUSY);
+
+	// TC3 overflow -> ADC start, asynchronous so it needs no clock
+	EVSYS->USER.reg = EVSYS_USER_USER(EVSYS_ID_USER_ADC_START) |
+		EVSYS_USER_CHANNEL(SCAN_SCHED_EVSYS_CH + 1);
+	EVSYS->CHANNEL.reg = EVSYS_CHANNEL_CHANNEL(SCAN_SCHED_EVSYS_CH) |
+		EVSYS_CHANNEL_EVGEN(EVSYS_ID_GEN_TC3_OVF) |
+		EVSYS_CHANNEL_PATH_ASYNCHRONOUS;
+}
+
+
+void
+scan_sched_start(void)
+{
+	have_last_frame = false;
+	SCAN_SCHED_TC->COUNT16.COUNT.reg = 0;
+	SCAN_SCHED_TC->COUNT16.CTRLA.reg |= TC_CTRLA_ENABLE;
+	while (SCAN_SCHED_TC->COUNT16.STATUS.reg & TC_STATUS_SYNCBUSY);
+}
+
+
+void
+scan_sched_stop(void)
+{
+	SCAN_SCHED_TC->COUNT16.CTRLA.reg &= ~TC_CTRLA_ENABLE;
+	while (SCAN_SCHED_TC->COUNT16.STATUS.reg & TC_STATUS_SYNCBUSY);
+}
+
+
+void
+scan_sched_frame_done(bool previous_unread)
+{
+	uint32_t now = timebase_now();
+
+	scan_sched_stats.frames++;
+	if (previous_unread) {
+		scan_sched_stats.dropped++;
+	}
+	if (have_last_frame) {
+		uint32_t period = timebase_elapsed(last_frame_stamp, now);
+		uint32_t nominal = scan_sched_stats.period_nominal;
+		uint32_t jitter = (period > nominal) ? period - nominal : nominal - period;
+
+		if (period < scan_sched_stats.period_min) {
+			scan_sched_stats.period_min = period;
+		}
+		if (period > scan_sched_stats.period_max) {
+			scan_sched_stats.period_max = period;
+		}
+		if (jitter > scan_sched_stats.jitter_max) {
+			scan_sched_stats.jitter_max = jitter;
+		}
+		if (period >= nominal + slot_cycles) {
+			scan_sched_stats.overruns++;
+		}
+	}
+	last_frame_stamp = now;
+	have_last_frame = true;
+}
@@ -0,0 +1,60 @@
+#ifndef _SCAN_SCHED_H_
+#define _SCAN_SCHED_H_
+
+#include <asf.h>
+#include "conf_controls.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// TC3 overflows once per scan slot and its event starts the next ADC
+// conversion through the event system, so every slot of the frame gets
+// sampled at exactly rate_hz no matter how long the main loop takes
+
+// cpu cycles one slot needs for sampling, 12 bit conversion and accumulation
+#define SCAN_SCHED_SLOT_MIN_CYCLES \
+	(((((CONF_ADC_SAMPLE_LENGTH) + 2) / 2) + 7) * (CONF_ADC_CLOCK_PRESCALER) << (CONF_ADC_ACCUMULATE_LOG2))
+// cpu cycles into a slot until the ADC took its last sample of the input,
+// it may change from then on
+#define SCAN_SCHED_SLOT_SAMPLED_CYCLES \
+	(SCAN_SCHED_SLOT_MIN_CYCLES - 5 * (CONF_ADC_CLOCK_PRESCALER))
+
+// DMA trigger that fires once per slot at SCAN_SCHED_SLOT_SAMPLED_CYCLES
+// (or later if the slot got stretched to fit the scan rate)
+#define SCAN_SCHED_DMAC_ID_SAMPLED   TC3_DMAC_ID_MC_1
+
+// all periods are in cpu cycles
+typedef struct {
+	uint32_t frames;
+	uint32_t period_nominal;
+	uint32_t period_min;
+	uint32_t period_max;
+	// largest distance of a frame period from the nominal one
+	uint32_t jitter_max;
+	// frames that came in a slot or more late (a trigger got lost)
+	uint32_t overruns;
+	// frames the DMA replaced before the main loop picked them up
+	uint32_t dropped;
+	// the requested rate was too fast for the ADC settings
+	bool rate_clamped;
+	// throughput: conversions per frame, the frame rate they get scheduled
+	// at and the fastest one the ADC settings allow for them
+	uint16_t slots;
+	uint32_t rate_hz;
+	uint32_t max_rate_hz;
+} scan_sched_stats_t;
+
+extern volatile scan_sched_stats_t scan_sched_stats;
+
+void scan_sched_init(uint16_t rate_hz, uint16_t n_slots);
+void scan_sched_start(void);
+void scan_sched_stop(void);
+
+// called from the DMA interrupt for each complete frame
+void scan_sched_frame_done(bool previous_unread);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // _SCAN_SCHED_H_
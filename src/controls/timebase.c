@@ -0,0 +1,11 @@
+#include <asf.h>
+#include "controls/timebase.h"
+
+volatile uint32_t timebase_high = 0;
+
+
+void
+SysTick_Handler(void)
+{
+	timebase_high += TIMEBASE_WRAP;
+}
@@ -0,0 +1,49 @@
+#ifndef _TIMEBASE_H_
+#define _TIMEBASE_H_
+
+#include <asf.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// SysTick free runs as a 24 bit cpu cycle counter, nothing else uses it.
+// its interrupt counts the wraps (every ~349ms at 48MHz) into the top 8
+// bits, so stamps are 32 bit and differences are good for ~89s
+#define TIMEBASE_MASK   0x00ffffffUL
+#define TIMEBASE_WRAP   (TIMEBASE_MASK + 1)
+
+// the top bits of the timebase, see SysTick_Handler()
+extern volatile uint32_t timebase_high;
+
+static inline void timebase_init(void) {
+	SysTick->LOAD = TIMEBASE_MASK;
+	SysTick->VAL = 0;
+	timebase_high = 0;
+	SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_TICKINT_Msk | SysTick_CTRL_ENABLE_Msk;
+}
+
+// SysTick counts down, flip it so later stamps are bigger.  this gets
+// called with interrupts off too, so a wrap the handler didn't get to yet
+// is counted here
+static inline uint32_t timebase_now(void) {
+	irqflags_t flags = cpu_irq_save();
+	uint32_t high = timebase_high;
+	uint32_t low = SysTick->VAL;
+
+	if (SCB->ICSR & SCB_ICSR_PENDSTSET_Msk) {
+		high += TIMEBASE_WRAP;
+		low = SysTick->VAL;
+	}
+	cpu_irq_restore(flags);
+	return high + (TIMEBASE_MASK - low);
+}
+
+static inline uint32_t timebase_elapsed(uint32_t start, uint32_t end) {
+	return end - start;
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif // _TIMEBASE_H_
@@ -7,19 +7,57 @@
 #define F_CPU 48000000UL
 
 #include <asf.h>
+#include "controls/adc_scan.h"
+#include "controls/scan_sched.h"
+#include "controls/filter.h"
+#include "controls/control_map.h"
+#include "controls/calibration.h"
+#include "controls/ratiometric.h"
+#include "controls/noise_guard.h"
+#include "controls/pitchbend.h"
+#include "controls/curve.h"
+#include "controls/block_filter.h"
+#include "controls/timebase.h"
+#include "midi/sysex.h"
 
 
 extern volatile bool DEVICE_ENUMERATED_RUNNING; 
-#define N_CTRLS   8
 
-#define PITCHBEND_CTRL_INPUT 0
 uint8_t controller_value[N_CTRLS];
+// 14 bit CCs and NRPNs: the last value handled and the last MSB the host got
+uint16_t controller_value14[N_CTRLS];
+uint8_t controller_msb14[N_CTRLS] = { [0 ... N_CTRLS-1] = 0xff };
+// when the frame being handled got sampled, goes along with every value
+// for the end to end latency
+uint32_t frame_stamp;
+
+// frame slot and type of each control, from the table in conf_controls.h
+static const uint16_t ctrl_slot[N_CTRLS] = CONTROL_MAP_SLOTS;
+static const uint8_t ctrl_type[N_CTRLS] = CONTROL_MAP_TYPES;
+static const uint8_t ctrl_curve[N_CTRLS] = CONTROL_MAP_CURVES;
+
+// filter pipeline of each control
+static const filter_stage_t ctrl_filter_conf[N_CTRLS][FILTER_MAX_STAGES] = CONTROL_MAP_FILTERS;
+filter_t ctrl_filter[N_CTRLS];
+
+// hysteresis guard around the bins, in raw counts
+#if CONF_AUTO_GUARD
+noise_guard_t ctrl_noise[N_CTRLS];
+#define CTRL_GUARD(i)  ((int)ctrl_noise[i].guard)
+#elif CONF_RATIOMETRIC
+// the supply ripple is gone, only the ADC noise is left to guard against
+#define CTRL_GUARD(i)  (1<<2)
+#else
+#define CTRL_GUARD(i)  (1<<3)
+#endif
 
 struct adc_module adc_instance;
 
 void configure_adc(void);
-uint16_t adc_read_value(const uint8_t input_channel);
+void prime_controls(void);
 void scan_controls(bool output_changes);
+void handle_sysex(const uint8_t *data, uint8_t len, uint8_t flags);
+void handle_midi_in(void);
 
 
 void
@@ -28,140 +66,71 @@ configure_adc(void)
   struct adc_config config;
   adc_get_config_defaults(&config);
   config.reference_compensation_enable = false;
-  // REF max voltage is VDDANA-.6, // this is pin 20  
-  config.reference = ADC_REFERENCE_AREFA;   
   // INTVCC0 is 1/1.48 VDDANA   INTVCC1 is 1/2 VDDANA (but only for VDDANA>2.0)
-  //config.reference = ADC_REFERENCE_INTVCC1;  
+  config.reference = CONF_ADC_REFERENCE;
+  config.gain_factor = CONF_ADC_GAIN;
   // 0-63 ... controls the length of time the sampling is done
   // and controls the input impedence 
-  config.sample_length = 63;     
+  config.sample_length = CONF_ADC_SAMPLE_LENGTH;
   config.resolution = ADC_RESOLUTION_12BIT;
-  config.divide_result = ADC_DIVIDE_RESULT_128;
-  config.accumulate_samples = ADC_ACCUMULATE_SAMPLES_128;
+  config.divide_result = (enum adc_divide_result)CONF_ADC_ACCUMULATE_LOG2;
+  config.accumulate_samples = (enum adc_accumulate_samples)ADC_AVGCTRL_SAMPLENUM(CONF_ADC_ACCUMULATE_LOG2);
+  // scan over all the control inputs, one conversion per scheduler event,
+  // the DMA collects the results.  adc_scan_start() sets up the pin scan,
+  // only the pins in the control table get switched to the ADC
+  config.positive_input = (enum adc_positive_input)CONF_SCAN_FIRST_AIN;
+  config.event_action = ADC_EVENT_ACTION_START_CONV;
   config.pin_scan.inputs_to_scan = 0;
-  config.pin_scan.offset_start_scan = 0;
   // clock should be between 30k and 2.1MHz
-  config.clock_source = GCLK_GENERATOR_2;  
+  config.clock_source = GCLK_GENERATOR_0;
+  config.clock_prescaler = ATPASTE2(ADC_CLOCK_PRESCALER_DIV, CONF_ADC_CLOCK_PRESCALER);
+#if CONF_SCAN_WINDOW_WAKE
+  // lift every result by one so a 0 never shows up, see adc_scan_set_window()
+  config.correction.correction_enable = true;
+  config.correction.gain_correction = 2048;   // 1.0
+  config.correction.offset_correction = -ADC_SCAN_RESULT_OFFSET;
+#endif
   
   while (adc_init(&adc_instance, ADC, &config) != STATUS_OK);
   while (adc_enable(&adc_instance) != STATUS_OK);
   
+  static uint32_t ctrl_ain[N_CTRLS] = CONTROL_MAP_AINS;
+  adc_regular_ain_channel(ctrl_ain, N_CTRLS);
+  ratio_init();
+
+  adc_scan_init();
+  adc_scan_start(&adc_instance);
+  scan_sched_init(CONF_SCAN_RATE_HZ, ADC_SCAN_FRAME_LEN);
+  scan_sched_start();
 }
 
-// ADC_POSITIVE_INPUT_PIN2 is setup to be the VREFB
-uint16_t
-adc_read_value(const uint8_t input_channel) {
-  enum status_code status;
-  enum adc_positive_input input; 
-  uint16_t result;
-  int retries = 5000;
-  
-  switch (input_channel) { 
-  case 0:
-	input = ADC_POSITIVE_INPUT_PIN12;
-	break;
-  case 1: 
-    input = ADC_POSITIVE_INPUT_PIN13;
-    break;
-  case 2:
-    input = ADC_POSITIVE_INPUT_PIN14;
-    break;
-  case 3:
-    input = ADC_POSITIVE_INPUT_PIN15;
-    break;
-  case 4:
-    input = ADC_POSITIVE_INPUT_PIN5;
-    break;
-  case 5:
-    input = ADC_POSITIVE_INPUT_PIN4;
-    break; 
-  case 6:
-    input = ADC_POSITIVE_INPUT_PIN3;
-	break; 
-  case 7:
-    input = ADC_POSITIVE_INPUT_PIN2;
-	break;
-  case 8:
-	input = ADC_POSITIVE_INPUT_PIN15;
-    break; 
-  case 9:
-    input = ADC_POSITIVE_INPUT_PIN9;
-	break;
-  case 10: 
-	input = ADC_POSITIVE_INPUT_PIN10;
-	break;
-  case 11:
-	input = ADC_POSITIVE_INPUT_PIN11;
-	break;
-  default:
-    return 0xffff;
-  }
-  
-  
-  adc_set_positive_input(&adc_instance, input);
-  adc_start_conversion(&adc_instance);
-  do {
-    status = adc_read(&adc_instance, &result);
-    retries--;
-  } while (status == STATUS_BUSY && retries > 0);
-  if (status != STATUS_OK) {
-    return 0xffff;
-  }
-  return result;
-}
-
-
-
-
 uint16_t current_pitchbend_value = 0x2000;
 uint16_t last_sent_pitchbend_value = 0xffff;
 
-// the end points and mid point are of particular interest for the sake of tuning
-// so make sure we cover the whole region even though we may not get the adc values
-// < 100 or > 16200
-
-inline uint16_t fixup_pitchbend_value(uint16_t value) {
-	
-	int32_t temp = value; 
-	temp -= 8192;    // center around 0
-	temp *= 1008; // ideally we want to multiply by ~1.012358648 to scale just slightly bigger use 1012/1000
-	temp /= 1000;
-	temp += 8192;    // put it back to the normal center
-
-	if (temp < 0) {
-		temp = 0;
-	} else if (temp > 16383) {
-		temp = 16383;
-	} else if ((temp > 8192-100) && (temp < 8192+100)) {
-		temp = 8192;
-	}
-	return (uint16_t)temp;
-}
+// the calibration already stretches the learned end points to 0 and 16383
+// and puts the rest position on 8192, the pitchbend table adds the curve
+// and the deadband
 
+// smallest change of the (14 bit) raw value handle_pitchbend() reacts to
+#define PITCHBEND_CHANGE_MIN(i)   ((CTRL_GUARD(i) << 2) - 1)
 
-inline void handle_pitchbend(bool output_changes, int i, uint16_t value) {
+static inline void handle_pitchbend(bool output_changes, int i, uint16_t value) {
     
     // this is signed so we can deal with the 0 bin appropriately 
 	
-	//	value = (value>>5)<<7        ;
-	value = value << 2; 
+	// value is 14 bit already and has the deadband, see pitchbend_lookup()
 
-	uint16_t fixedup_pitchbend_value = 0;
-
-	bool controller_changed = abs(value - current_pitchbend_value) > 0x1f;
+	bool controller_changed = abs(value - current_pitchbend_value) > PITCHBEND_CHANGE_MIN(i);
 
 
     if (controller_changed) {
-		current_pitchbend_value += (value - current_pitchbend_value)/4;
+		// the smoothing is done by the control's filter pipeline
+		current_pitchbend_value = value;
 		
-	  // we clamp the values and put a deadband in the center
-	  // so we might have already sent a 0 or 0x4000 or 0x2000 even though
-	  // the raw value changed
-	  fixedup_pitchbend_value = fixup_pitchbend_value(current_pitchbend_value);
-      if (output_changes && fixedup_pitchbend_value != last_sent_pitchbend_value) {
+      if (output_changes && current_pitchbend_value != last_sent_pitchbend_value) {
         // only record the value, if we actually got it in the queue
-		if (enqueue_ctrl(CTRL_PITCHBEND, fixedup_pitchbend_value)) {
-			last_sent_pitchbend_value = fixedup_pitchbend_value;
+		if (enqueue_ctrl(CTRL_PITCHBEND, current_pitchbend_value, frame_stamp)) {
+			last_sent_pitchbend_value = current_pitchbend_value;
 		}
       } else {
         //current_pitchbend_value = value;		
@@ -173,26 +142,24 @@ inline void handle_pitchbend(bool output_changes, int i, uint16_t value) {
 // output_changes is true
 // we want to apply some hysteresis to the value change so:
 
-// there are 0-127 bins representing each control value
-// BIN2RAW converts the bin number to the raw adc value of the middle of a bin
-#define HALFBIN_SIZE   (1<<4)
-#define GUARD_SIZE     (1<<3)
-#define BIN2RAW(x)     (((x)<<5) + HALFBIN_SIZE)
+// there are 0-127 bins representing each control value, the control's
+// curve decides where they start and end on the raw side
+#define BIN_LOW(i, x)    ((int)curve_edge[ctrl_curve[i]][x])
+#define BIN_HIGH(i, x)   ((int)curve_edge[ctrl_curve[i]][(x)+1])
 
 
-inline void handle_ctrl_value(bool output_changes, int i, uint16_t value) {
-    uint8_t res = (value >> 5);  // scale from 0-0x0fff to 0-0x7f
+static inline void handle_ctrl_value(bool output_changes, int i, uint16_t value) {
+    uint8_t res = curve_apply(ctrl_curve[i], value);  // 0-0x0fff to 0-0x7f
     
     // this is signed so we can deal with the 0 bin appropriately 
-    int raw_bin_middle = (int)BIN2RAW(controller_value[i]);
-    int raw_bin_high = raw_bin_middle+HALFBIN_SIZE+GUARD_SIZE;
-    int raw_bin_low  = raw_bin_middle-HALFBIN_SIZE-GUARD_SIZE;
+    int raw_bin_high = BIN_HIGH(i, controller_value[i])+CTRL_GUARD(i);
+    int raw_bin_low  = BIN_LOW(i, controller_value[i])-CTRL_GUARD(i);
     bool controller_changed = (value > raw_bin_high) || (value < raw_bin_low);
     
     if (controller_changed) {
       if (output_changes) {
         // only record the value, if we actually got it in the queue
-		if (enqueue_ctrl(i, res)) {
+		if (enqueue_ctrl(i, res, frame_stamp)) {
 			controller_value [i] = res;
 		}
       } else {
@@ -201,21 +168,190 @@ inline void handle_ctrl_value(bool output_changes, int i, uint16_t value) {
 	}
 }
 
+// control_map.h makes sure every CTRL_TYPE_CC14 control has a CC pair to
+// go out on
+#define CTRL_IS_CC14(i)   (ctrl_type[i] == CTRL_TYPE_CC14)
+
+// n is CTRL_CC14 or CTRL_NRPN, both send MSB and LSB
+static inline void handle_ctrl14_value(bool output_changes, int i, uint8_t n, uint16_t value) {
+    // scale from 0-0x0fff to 0-0x3fff, the top bits fill in the bottom ones
+    // so the ends come out at 0 and 0x3fff
+    uint16_t res = (value << 2) | (value >> 10);
+    bool controller_changed = abs((int)value - (int)(controller_value14[i] >> 2)) > CTRL_GUARD(i);
+
+    if (controller_changed) {
+      controller_value14[i] = res;
+      controller_value[i] = res >> 7;
+      if (output_changes) {
+        // most moves stay within one MSB step, those only cost the LSB
+        uint16_t flags = ((res >> 7) == controller_msb14[i]) ? CTRL_LSB_ONLY : 0;
+		if (enqueue_ctrl(i | n, res | flags, frame_stamp)) {
+			controller_msb14[i] = res >> 7;
+		}
+      }
+	}
+}
+
+#if CONF_SCAN_WINDOW_WAKE
+// the raw values a control can read without handle_ctrl_value() or
+// handle_pitchbend() doing anything.  the ADC window monitor watches them
+static void update_ctrl_window(int i) {
+  int low, high, out_max;
+  if (ctrl_type[i] == CTRL_TYPE_PITCHBEND) {
+    // straight from the table, it knows about the curve and the deadband
+    low = (int)current_pitchbend_value - PITCHBEND_CHANGE_MIN(i);
+    low = pitchbend_unapply(i, (uint16_t)((low < 0) ? 0 : low));
+    high = (int)pitchbend_unapply(i, current_pitchbend_value + PITCHBEND_CHANGE_MIN(i) + 1) - 1;
+    adc_scan_set_window(ctrl_slot[i], (int16_t)ratio_unapply(low), (int16_t)ratio_unapply(high));
+    return;
+  } else if (CTRL_IS_CC14(i) || ctrl_type[i] == CTRL_TYPE_NRPN) {
+    low = (int)(controller_value14[i] >> 2) - CTRL_GUARD(i);
+    high = (int)(controller_value14[i] >> 2) + CTRL_GUARD(i);
+    out_max = 4095;
+  } else {
+    low = BIN_LOW(i, controller_value[i]) - CTRL_GUARD(i);
+    high = BIN_HIGH(i, controller_value[i]) + CTRL_GUARD(i);
+    out_max = 4095;
+  }
+  // back through the calibration and the reference scaling to raw values
+  low = ratio_unapply(calib_unapply(i, (uint16_t)((low < 0) ? 0 : low)));
+  high = ratio_unapply(calib_unapply(i, (uint16_t)((high > out_max) ? out_max : high)));
+  adc_scan_set_window(ctrl_slot[i], (int16_t)low, (int16_t)high);
+}
+#endif
+
+// start every filter off at the control's first reading, with its time
+// constants worked out for the rate the scheduler actually runs at
+void prime_controls(void) {
+  const uint16_t *frame = adc_scan_wait_frame();
+  ratio_update(frame);
+#if CONF_BLOCK_FILTER
+  block_filter_init(scan_sched_stats.rate_hz, frame);
+#else
+  for (int i = 0; i < N_CTRLS; i++) {
+    uint16_t v = ratio_apply(frame[ctrl_slot[i]] - ADC_SCAN_RESULT_OFFSET);
+    filter_init(&ctrl_filter[i], ctrl_filter_conf[i], scan_sched_stats.rate_hz, v);
+  }
+#endif
+}
+
 void scan_controls(bool output_changes) {
+  // the cpu sleeps while the DMA fills the next frame
+  const uint16_t *frame = adc_scan_wait_frame();
+  frame_stamp = adc_scan_frame_stamp();
+  ratio_update(frame);
+#if CONF_BLOCK_FILTER
+  // the filtering happens a block of frames at a time, the controls only
+  // get looked at once it's done
+  if (!block_filter_add(frame)) {
+    return;
+  }
+#else
+  uint32_t filter_cycles = 0;
+#endif
   for (int i = 0; i < N_CTRLS; i++) {
-    uint16_t v = adc_read_value(i);
-    if (v == 0xffff) {
-      continue; // error during adc_read
+    uint16_t v = frame[ctrl_slot[i]] - ADC_SCAN_RESULT_OFFSET;
+#if CONF_SCAN_WINDOW_WAKE
+    // the hardware already told us something moved, only look at what did
+    if (output_changes && !adc_scan_outside_window(ctrl_slot[i], v)) {
+      continue;
     }
-	if (i == PITCHBEND_CTRL_INPUT) {
-		handle_pitchbend(output_changes, i, v);   
+#endif
+#if CONF_BLOCK_FILTER
+#if CONF_AUTO_GUARD
+    uint16_t raw = ratio_apply(v);
+#endif
+    v = block_filter_value(i);
+#else
+    uint32_t start = timebase_now();
+    uint16_t raw = ratio_apply(v);
+    v = filter_run(&ctrl_filter[i], raw);
+    filter_cycles += timebase_elapsed(start, timebase_now());
+#endif
+#if CONF_AUTO_GUARD
+    // the noise is measured before the filter, after it the frames hardly
+    // differ even on a noisy channel
+    noise_guard_update(&ctrl_noise[i], raw, v);
+#endif
+    calib_learn(i, v);
+	if (ctrl_type[i] == CTRL_TYPE_PITCHBEND) {
+		calib_track_center(i, v);
+		handle_pitchbend(output_changes, i, pitchbend_lookup(i, v));   
+	} else if (CTRL_IS_CC14(i)) {
+		handle_ctrl14_value(output_changes, i, CTRL_CC14, calib_apply(i, v));
+	} else if (ctrl_type[i] == CTRL_TYPE_NRPN) {
+		handle_ctrl14_value(output_changes, i, CTRL_NRPN, calib_apply(i, v));
 	} else {  
-		handle_ctrl_value(output_changes, i, v);
+		handle_ctrl_value(output_changes, i, calib_apply(i, v));
 	}
+#if CONF_SCAN_WINDOW_WAKE
+    update_ctrl_window(i);
+#endif
   } // for
+#if !CONF_BLOCK_FILTER
+  filter_cycles_add(filter_cycles);
+#endif
 }
 
 
+// called from the USB interrupt when the host sent something
+void midi_rx_notify(void) {
+#if CONF_SCAN_WINDOW_WAKE
+  // the main loop only wakes up for frames, a quiet one has to come too
+  adc_scan_wake();
+#endif
+}
+
+// universal non realtime identity request / reply.  0x7d is the
+// manufacturer id for non commercial use, the version is the USB one
+#define SYSEX_DEVICE_ID   0x7f
+
+static const uint8_t identity_request[] = { 0xf0, 0x7e, SYSEX_DEVICE_ID, 0x06, 0x01, 0xf7 };
+static const uint8_t identity_reply[] = {
+  0xf0, 0x7e, SYSEX_DEVICE_ID, 0x06, 0x02, 0x7d, 0x00, 0x00, 0x00, 0x00,
+  USB_DEVICE_MAJOR_VERSION, USB_DEVICE_MINOR_VERSION, 0x00, 0x00, 0xf7
+};
+
+static sysex_rx_t sysex_in;
+static sysex_buffer_t sysex_out;
+// bytes of the identity request the message matched so far, 0xff once
+// it can't be one anymore
+static uint8_t identity_matched;
+
+// the host's SysEx, a chunk at a time.  a message can come in any number
+// of chunks, the match carries over from one to the next
+void handle_sysex(const uint8_t *data, uint8_t len, uint8_t flags) {
+  if (flags & SYSEX_START) {
+    identity_matched = 0;
+  }
+  for (uint8_t k = 0; k < len; k++) {
+    if (identity_matched < sizeof(identity_request) &&
+        data[k] == identity_request[identity_matched]) {
+      identity_matched++;
+    } else {
+      identity_matched = 0xff;
+    }
+  }
+  if (!(flags & SYSEX_END) || (flags & SYSEX_ABORTED)) {
+    return;
+  }
+  if (identity_matched == sizeof(identity_request) && !udi_midi_sysex_busy()) {
+    sysex_out.data = identity_reply;
+    sysex_out.left = sizeof(identity_reply);
+    udi_midi_sysex_send(sysex_buffer_next, &sysex_out);
+  }
+}
+
+// the controller only listens to SysEx, channel messages from the host
+// just show up in udi_midi_rx_stats.  everything still has to be taken
+// out so the endpoint doesn't stay NAKed
+void handle_midi_in(void) {
+  uint32_t event;
+  while (udi_midi_rx_get(&event)) {
+    sysex_rx_event(&sysex_in, event);
+  }
+}
+
 int main (void)
 {
   DEVICE_ENUMERATED_RUNNING = false;
@@ -224,16 +360,21 @@ int main (void)
   cpu_irq_enable();
   sleepmgr_init();
   udc_start();
+  calib_init();
+  curve_init();
+  sysex_rx_init(&sysex_in, handle_sysex);
   configure_adc();
+  prime_controls();
   scan_controls(false);
 
   while (1) {
 
 	while (DEVICE_ENUMERATED_RUNNING) { 
+	    // paced by the scan scheduler, no need for a delay here
 	    scan_controls(true);
-		// is this a good tradeoff...we don't want to inundate the
-		// host with events
-		delay_ms(5);
+	    udi_midi_flush();
+	    calib_poll();
+	    handle_midi_in();
 	}
 	sleepmgr_sleep(SLEEPMGR_IDLE_0);
   }
@@ -0,0 +1,99 @@
+#include <asf.h>
+#include "midi/ctrl_pack.h"
+#include "midi/device/udi_midi.h"
+
+#define MIDI_CHANNEL    0
+#define NRPN_NONE       0xffff
+
+// the NRPN the receiver has selected on our channel
+static uint16_t nrpn_selected = NRPN_NONE;
+
+
+void
+ctrl_pack_reset(void)
+{
+	nrpn_selected = NRPN_NONE;
+}
+
+
+static uint8_t
+put_cc(uint8_t *buf, uint8_t cc, uint8_t value)
+{
+	buf[0] = 0x0b;
+	buf[1] = 0xb0 | MIDI_CHANNEL;
+	buf[2] = cc;
+	buf[3] = value & 0x7f;
+	// a parameter select for anything else than what nrpn_selected
+	// tracks, the next NRPN has to select again
+	if (cc >= 98 && cc <= 101) {
+		nrpn_selected = NRPN_NONE;
+	}
+	return 4;
+}
+
+
+// the data entry MSB the receiver holds came with some other parameter
+// when it gets selected again, the LSB alone can't go out then
+static bool
+nrpn_lsb_only(uint8_t n, uint16_t value)
+{
+	return (value & CTRL_LSB_ONLY) && nrpn_selected == (n&0x3f) + CTRL_NRPN_FIRST;
+}
+
+
+uint8_t
+ctrl_pack_size(uint8_t n, uint16_t value)
+{
+	if ((n&0xf0) == CTRL_PITCHBEND) {
+		return 4;
+	}
+	if ((n&0xc0) == CTRL_CC14) {
+		return (value & CTRL_LSB_ONLY) ? 4 : 8;
+	}
+	if ((n&0xc0) == CTRL_NRPN) {
+		if (nrpn_selected != (n&0x3f) + CTRL_NRPN_FIRST) {
+			return 16;
+		}
+		return nrpn_lsb_only(n, value) ? 4 : 8;
+	}
+	return 4;
+}
+
+
+uint8_t
+ctrl_pack(uint8_t *buf, uint8_t n, uint16_t value)
+{
+	uint8_t count = 0;
+
+	if ((n&0xf0) == CTRL_PITCHBEND) {
+		buf[0] = 0x0e;
+		buf[1] = 0xe0 | MIDI_CHANNEL;
+		buf[2] = (uint8_t)(value & 0x7f);
+		buf[3] = (uint8_t)((value >> 7) & 0x7f);
+		count = 4;
+	} else if ((n&0xc0) == CTRL_CC14) {
+		// MSB first, receivers reset the LSB when they get one
+		n = (n&0x3f) + CTRL_CC_FIRST;
+		if (!(value & CTRL_LSB_ONLY)) {
+			count += put_cc(&buf[count], n, (uint8_t)(value >> 7));
+		}
+		count += put_cc(&buf[count], n+32, (uint8_t)value);
+	} else if ((n&0xc0) == CTRL_NRPN) {
+		uint16_t param = (n&0x3f) + CTRL_NRPN_FIRST;
+		bool lsb_only = nrpn_lsb_only(n, value);
+
+		if (nrpn_selected != param) {
+			count += put_cc(&buf[count], 99, (uint8_t)(param >> 7));
+			count += put_cc(&buf[count], 98, (uint8_t)param);
+			nrpn_selected = param;
+		}
+		if (!lsb_only) {
+			count += put_cc(&buf[count], 6, (uint8_t)(value >> 7));
+		}
+		count += put_cc(&buf[count], 38, (uint8_t)value);
+	} else {
+		// default 0-127 controller
+		count += put_cc(&buf[count], n + CTRL_CC_FIRST, (uint8_t)value);
+	}
+	return count;
+}
@@ -0,0 +1,26 @@
+#ifndef _CTRL_PACK_H_
+#define _CTRL_PACK_H_
+
+#include <asf.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// turns a control value from the store into USB MIDI event packets, see
+// enqueue_ctrl() for what n and value hold.  everything goes out on
+// channel 0.  the NRPN selected last is remembered so a repeated parameter
+// select can be left out, the packets have to go out in the order they
+// got packed
+
+// forget the NRPN selection, for a new host
+void ctrl_pack_reset(void);
+// the number of bytes ctrl_pack() will put out for n and value
+uint8_t ctrl_pack_size(uint8_t n, uint16_t value);
+// puts the packets into buf, returns the number of bytes
+uint8_t ctrl_pack(uint8_t *buf, uint8_t n, uint16_t value);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // _CTRL_PACK_H_
@@ -6,6 +6,8 @@
 #include "udd.h"
 #include "udc.h"
 #include "midi/device/udi_midi.h"
+#include "midi/ctrl_pack.h"
+#include "controls/timebase.h"
 #include <string.h>
 
 
@@ -55,104 +57,482 @@ UDC_DESC_STORAGE udi_api_t udi_api_midi = {
 extern udd_ep_job_t* udd_ep_get_job(udd_ep_id_t ep);
 
 
-bool dequeue_ctrl(uint8_t * n, uint16_t * value);
-uint8_t move_queue_to_buffer(void);
+uint16_t move_queue_to_buffer(uint16_t count);
+static void transmit_if_idle(void);
 void ep1_transmit_callback (udd_ep_status_t status, iram_size_t nb_transfered, udd_ep_id_t ep);
+static void rx_callback(udd_ep_status_t status, iram_size_t nb_transfered, udd_ep_id_t ep);
 
 
-UDC_DESC_STORAGE uint8_t out_buffer[64];
+// two IN buffers taking turns: while one is on the wire the next transfer
+// gets built in the other, it goes out as soon as the endpoint is free.
+// out_buffer is the one being built, out_len[] the bytes in each, 0 when
+// there's nothing waiting in it.  both only get touched from the USB
+// interrupt.  a transfer can be several packets, udd splits it up, so a
+// burst of changes goes out in one go rather than 64 bytes per transfer
+#define UDI_MIDI_EP_SIZE   64
+_Static_assert(UDI_MIDI_TX_BUFFER_SIZE % UDI_MIDI_EP_SIZE == 0, "the IN buffer must hold whole packets");
+// udd takes jobs of up to 8k-1 bytes
+_Static_assert(UDI_MIDI_TX_BUFFER_SIZE < 8*1024, "the IN buffer must fit one udd job");
+
+volatile bool DEVICE_ENUMERATED_RUNNING = false;
+
+// the USB DMA reads the transfers straight out of these
+COMPILER_WORD_ALIGNED static uint8_t out_buffers[2][UDI_MIDI_TX_BUFFER_SIZE];
+static uint8_t out_fill = 0;
+static uint8_t *out_buffer = out_buffers[0];
+static uint16_t out_len[2];
+
+// MIDI OUT: udd reads straight into rx_buffer (it has to be word aligned
+// and whole packets for that), the events get checked right there and go
+// into the ring.  the read only gets rearmed once the ring has room for
+// another full packet, until then the host is NAKed and rx_waiting holds
+// the bytes still to be taken out
+_Static_assert((UDI_MIDI_RX_RING_SIZE & (UDI_MIDI_RX_RING_SIZE - 1)) == 0, "the receive ring must be a power of 2");
+_Static_assert(UDI_MIDI_RX_RING_SIZE >= UDI_MIDI_EP_SIZE / 4, "the receive ring must hold a packet");
+
+COMPILER_WORD_ALIGNED static uint8_t rx_buffer[UDI_MIDI_EP_SIZE];
+static volatile uint16_t rx_waiting = 0;
+static volatile uint32_t rx_ring[UDI_MIDI_RX_RING_SIZE];
+// head is only written by the USB interrupt, tail by the main loop
+static volatile uint16_t rx_head = 0;
+static volatile uint16_t rx_tail = 0;
+
+volatile udi_midi_rx_stats_t udi_midi_rx_stats;
+
+// latest value store: one slot per control (and one for the pitchbend)
+// holding the newest value that hasn't gone out yet, and a bit per slot
+// saying it's waiting.  a control that changes again before the next
+// transfer just gets its slot overwritten, so a sweep costs at most one
+// message per control and transfer and the final value always goes out.
+// the main loop fills it with interrupts off just for the slot and its
+// bit, the USB interrupt and udi_midi_flush() drain it
+#define CTRL_KEYS            65
+#define CTRL_KEY_PITCHBEND   64
+#define CTRL_DIRTY_WORDS     ((CTRL_KEYS + 31) / 32)
 
 typedef struct {
-	uint8_t n;
-	uint16_t value; 
-} ctrlq_entry_t;
+	uint32_t dirty[CTRL_DIRTY_WORDS];
+	// n << 16 | value
+	uint32_t slot[CTRL_KEYS];
+	// when the slot started waiting
+	uint32_t stamp[CTRL_KEYS];
+	// when the value in the slot got sampled
+	uint32_t sampled[CTRL_KEYS];
+	// waiting slots, per lane
+	uint8_t pending[CTRL_N_LANES];
+} ctrl_store_t;
+
+static volatile ctrl_store_t ctrls;
+
+// priority lanes, each a range of slots.  every transfer gets filled from
+// the highest lane down, a lane that had to wait CTRL_LANE_MAX_WAIT
+// transfers without getting anything out goes first the next time so a
+// flood in a higher lane can't hold it up for good
+#define CTRL_LANE_MAX_WAIT   2
 
 typedef struct {
-	uint8_t size;
-	uint8_t read_idx;
-	uint8_t write_idx;
-	ctrlq_entry_t q[128];  
-} ctrlq_t;
+	uint8_t first;
+	uint8_t n_keys;
+	// where the next drain starts, so a full transfer doesn't always leave
+	// the same controls waiting
+	uint8_t next;
+	uint8_t starved;
+} ctrl_lane_t;
+
+static ctrl_lane_t ctrl_lanes[CTRL_N_LANES] = {
+	[CTRL_LANE_PITCHBEND] = { CTRL_KEY_PITCHBEND, 1, CTRL_KEY_PITCHBEND, 0 },
+	[CTRL_LANE_CC] = { 0, 64, 0, 0 },
+};
 
-ctrlq_t ctrlq = { 128, 0, 0, {{0}} };
+volatile ctrlq_lane_stats_t ctrlq_lane_stats[CTRL_N_LANES];
 
+volatile ctrlq_stats_t ctrlq_stats;
 
+volatile ctrl_latency_stats_t ctrl_latency_stats = { .min_us = 0xffffffff };
+// what the host gets, a copy so the interrupt can't change it halfway
+static ctrl_latency_stats_t latency_report;
+static uint32_t cycles_per_us = 48;
 
-bool enqueue_ctrl(uint8_t n, uint16_t value) {
-	uint8_t idx = (ctrlq.write_idx+1)%ctrlq.size;
-	if (idx == ctrlq.read_idx) {
-		return false;
+// sample stamps of the values in each buffer
+static uint32_t out_sampled[2][UDI_MIDI_TX_BUFFER_SIZE / 4];
+static uint16_t out_n_sampled[2];
+
+volatile udi_midi_tx_stats_t udi_midi_tx_stats;
+
+// the SysEx going out, NULL when there's none
+static volatile udi_midi_sysex_source_t sysex_next = NULL;
+static void *sysex_ctx;
+// its F0 is out.  any other status byte ends a SysEx for the host, so
+// nothing else goes until the F7.  realtime messages could, but the
+// controller sends none
+static bool sysex_open = false;
+
+
+
+static inline uint8_t ctrl_key(uint8_t n) {
+	return ((n&0xf0) == CTRL_PITCHBEND) ? CTRL_KEY_PITCHBEND : (n&0x3f);
+}
+
+
+static inline uint8_t ctrl_lane(uint8_t key) {
+	return (key == CTRL_KEY_PITCHBEND) ? CTRL_LANE_PITCHBEND : CTRL_LANE_CC;
+}
+
+
+// never fails, a value that's still waiting gets replaced
+bool enqueue_ctrl(uint8_t n, uint16_t value, uint32_t sampled) {
+	uint8_t key = ctrl_key(n);
+	uint32_t bit = 1UL << (key & 31);
+	irqflags_t flags = cpu_irq_save();
+
+	if (ctrls.dirty[key >> 5] & bit) {
+		// an MSB that's waiting to go out still has to
+		if (!(ctrls.slot[key] & CTRL_LSB_ONLY)) {
+			value &= ~CTRL_LSB_ONLY;
+		}
+		ctrlq_stats.coalesced++;
+	} else {
+		ctrls.dirty[key >> 5] |= bit;
+		ctrls.stamp[key] = timebase_now();
+		ctrls.pending[ctrl_lane(key)]++;
+		uint8_t pending = ctrls.pending[CTRL_LANE_PITCHBEND] + ctrls.pending[CTRL_LANE_CC];
+		if (pending > ctrlq_stats.high_water) {
+			ctrlq_stats.high_water = pending;
+		}
 	}
-	ctrlq.q[idx].n = n;
-	ctrlq.q[idx].value = value;
-	ctrlq.write_idx = idx;
+	ctrls.slot[key] = ((uint32_t)n << 16) | value;
+	ctrls.sampled[key] = sampled;
+	ctrlq_stats.enqueued++;
+	cpu_irq_restore(flags);
 	return true;
 }
 
 
-bool dequeue_ctrl(uint8_t * n, uint16_t * value) {
-	if (ctrlq.write_idx == ctrlq.read_idx) {
-		return false;
+// an idle endpoint doesn't have to wait for the next SOF.  only the USB
+// interrupt is masked while the transfer gets built, the rest keep running
+void udi_midi_flush(void) {
+	NVIC_DisableIRQ(USB_IRQn);
+	__DSB();
+	__ISB();
+	transmit_if_idle();
+	NVIC_EnableIRQ(USB_IRQn);
+}
+
+
+// moves what's waiting in a lane to out_buffer until it's full.  a slot
+// only gets cleared once all its packets fit, so both halves of a 14 bit
+// CC or an NRPN always go out in the same transfer
+static uint16_t drain_lane(uint8_t l, uint16_t count, uint32_t now) {
+	ctrl_lane_t *lane = &ctrl_lanes[l];
+	uint8_t end = lane->first + lane->n_keys;
+	uint8_t key = lane->next;
+	bool sent = false;
+
+	for (uint8_t seen = 0; seen < lane->n_keys; ) {
+		uint32_t word = ctrls.dirty[key >> 5];
+		if (word == 0) {
+			// nothing waiting in this word, on to the next one
+			uint8_t step = 32 - (key & 31);
+			if (key + step > end) {
+				step = end - key;
+			}
+			seen += step;
+			key = (key + step == end) ? lane->first : key + step;
+			continue;
+		}
+		seen++;
+		if (!(word & (1UL << (key & 31)))) {
+			key = (key + 1 == end) ? lane->first : key + 1;
+			continue;
+		}
+		uint8_t n = (uint8_t)(ctrls.slot[key] >> 16);
+		uint16_t value = (uint16_t)ctrls.slot[key];
+		if (count + ctrl_pack_size(n, value) > UDI_MIDI_TX_BUFFER_SIZE) {
+			break;
+		}
+		ctrls.dirty[key >> 5] = word & ~(1UL << (key & 31));
+		ctrls.pending[l]--;
+		count += ctrl_pack(&out_buffer[count], n, value);
+		out_sampled[out_fill][out_n_sampled[out_fill]++] = ctrls.sampled[key];
+		sent = true;
+
+		uint32_t latency = timebase_elapsed(ctrls.stamp[key], now);
+		ctrlq_lane_stats[l].sent++;
+		if (latency > ctrlq_lane_stats[l].latency_max) {
+			ctrlq_lane_stats[l].latency_max = latency;
+		}
+		ctrlq_lane_stats[l].latency_avg += ((int32_t)(latency - ctrlq_lane_stats[l].latency_avg)) >> 4;
+		key = (key + 1 == end) ? lane->first : key + 1;
 	}
-	uint8_t pos = (ctrlq.read_idx+1)%ctrlq.size;
-	*n = ctrlq.q[pos].n;
-	*value = ctrlq.q[pos].value;
-	ctrlq.read_idx = pos;
-	return true;
+	lane->next = key;
+
+	// it had something and got nothing out
+	if (!sent && ctrls.pending[l] > 0) {
+		lane->starved++;
+	} else {
+		lane->starved = 0;
+	}
+	return count;
+}
+
+
+// cuts the outgoing SysEx into event packets while out_buffer has room:
+// CIN 0x4 for three bytes on the way, 0x5-0x7 for the last one to three
+// with the F7
+static uint16_t pack_sysex(uint16_t count) {
+	while (sysex_next != NULL && count + 4 <= UDI_MIDI_TX_BUFFER_SIZE) {
+		uint8_t *p = &out_buffer[count];
+		uint8_t cin = 0x4;
+
+		p[1] = p[2] = p[3] = 0;
+		for (uint8_t k = 0; k < 3; k++) {
+			int16_t b = sysex_next(sysex_ctx);
+
+			// a source that ran out before its first byte sends nothing,
+			// a lone F7 would look like the end of somebody else's SysEx
+			if (b < 0 && !sysex_open && k == 0) {
+				sysex_next = NULL;
+				return count;
+			}
+			// the F7 when the source ran out
+			p[k+1] = (b < 0) ? 0xf7 : (uint8_t)b;
+			if (p[k+1] == 0xf7) {
+				cin = 0x5 + k;
+				sysex_next = NULL;
+				break;
+			}
+		}
+		p[0] = cin;
+		count += 4;
+		sysex_open = (sysex_next != NULL);
+	}
+	return count;
+}
+
+
+bool udi_midi_sysex_send(udi_midi_sysex_source_t next, void *ctx) {
+	irqflags_t flags = cpu_irq_save();
+	bool ok = (sysex_next == NULL);
+
+	if (ok) {
+		sysex_ctx = ctx;
+		sysex_next = next;
+	}
+	cpu_irq_restore(flags);
+	if (ok) {
+		udi_midi_flush();
+	}
+	return ok;
 }
 
-// this must only happen when the buffer is not in use
+
+bool udi_midi_sysex_busy(void) {
+	return sysex_next != NULL;
+}
+
+
+// adds to out_buffer from count on, it must not be on the wire
 // returns number of bytes
-uint8_t move_queue_to_buffer(void) {
-	uint8_t n; 
-	uint16_t value;
-	uint8_t count = 0; 
-	while (dequeue_ctrl(&n, &value)) {
-
-		if ((n&0xf0) == CTRL_PITCHBEND) {
-			out_buffer[count+0] = 0x0e;
-			out_buffer[count+1] = 0xe0;
-			out_buffer[count+2] = (uint8_t)((value)&0x7f);
-			out_buffer[count+3] = (uint8_t)((value>>7)&0x7f);
-			count+=4;		 
-		} else { 
-			// default 0-127 controller
-			out_buffer[count+0] = 0x0b; 
-			out_buffer[count+1] = 0xb0;
-			out_buffer[count+2] = n+11;
-			out_buffer[count+3] = (uint8_t)value;
-			count+=4;
+uint16_t move_queue_to_buffer(uint16_t count) {
+	uint32_t now = timebase_now();
+	uint8_t urgent = CTRL_N_LANES;
+
+	// a SysEx on its way has the transfers to itself, the controls wait in
+	// their slots
+	if (sysex_open) {
+		count = pack_sysex(count);
+		if (sysex_open) {
+			return count;
 		}
-		if (count >= (sizeof(out_buffer))) {
+	}
+	// a lane that waited too long goes before everything else, the lowest
+	// one first
+	for (uint8_t l = CTRL_N_LANES; l-- > 0; ) {
+		if (ctrl_lanes[l].starved >= CTRL_LANE_MAX_WAIT) {
+			urgent = l;
+			count = drain_lane(l, count, now);
 			break;
 		}
 	}
-	return count;
+	for (uint8_t l = 0; l < CTRL_N_LANES; l++) {
+		if (l != urgent) {
+			count = drain_lane(l, count, now);
+		}
+	}
+	// SysEx gets what's left
+	return pack_sysex(count);
 }
 
 
 
+
+static void clear_latency(void) {
+	irqflags_t flags = cpu_irq_save();
+	ctrl_latency_stats.events = 0;
+	ctrl_latency_stats.min_us = 0xffffffff;
+	ctrl_latency_stats.avg_us = 0;
+	ctrl_latency_stats.max_us = 0;
+	for (uint8_t k = 0; k < CTRL_LATENCY_BUCKETS; k++) {
+		ctrl_latency_stats.hist[k] = 0;
+	}
+	cpu_irq_restore(flags);
+}
+
+
+// the values in buffer b went to the hardware at now
+static void record_latency(uint8_t b, uint32_t now) {
+	for (uint16_t j = 0; j < out_n_sampled[b]; j++) {
+		uint32_t us = timebase_elapsed(out_sampled[b][j], now) / cycles_per_us;
+		uint32_t k = us / CTRL_LATENCY_BUCKET_US;
+
+		if (ctrl_latency_stats.events++ == 0) {
+			ctrl_latency_stats.avg_us = us;
+		}
+		ctrl_latency_stats.avg_us += ((int32_t)(us - ctrl_latency_stats.avg_us)) >> 4;
+		if (us < ctrl_latency_stats.min_us) {
+			ctrl_latency_stats.min_us = us;
+		}
+		if (us > ctrl_latency_stats.max_us) {
+			ctrl_latency_stats.max_us = us;
+		}
+		ctrl_latency_stats.hist[(k < CTRL_LATENCY_BUCKETS) ? k : CTRL_LATENCY_BUCKETS - 1]++;
+	}
+}
+
+
+// hands out_buffer to the endpoint, which must be free, and starts
+// building in the other one
+static void send_out_buffer(void) {
+	uint8_t b = out_fill;
+	uint16_t n_bytes = out_len[b];
+	uint32_t now = timebase_now();
+
+	// a transfer that ends on a packet boundary gets a zero length packet
+	// so the host knows it's over, udd only sends one then
+	if (!udd_ep_run(0x82, true, out_buffers[b], n_bytes, &ep1_transmit_callback)) {
+		// it stays put for the next try
+		return;
+	}
+	record_latency(b, now);
+	udi_midi_tx_stats.transfers++;
+	udi_midi_tx_stats.bytes += n_bytes;
+
+	out_fill = b ^ 1;
+	out_buffer = out_buffers[out_fill];
+	out_len[out_fill] = 0;
+	out_n_sampled[out_fill] = 0;
+}
+
+
+// starts a transfer with what's waiting if the endpoint is free.  runs in
+// the USB interrupt or with it masked
+static void transmit_if_idle(void) {
+	udd_ep_job_t * ptr_job = udd_ep_get_job(0x82);
+	if (DEVICE_ENUMERATED_RUNNING && ptr_job != NULL && !ptr_job->busy) {
+		out_len[out_fill] = move_queue_to_buffer(out_len[out_fill]);
+		if (out_len[out_fill] > 0) {
+			send_out_buffer();
+		}
+	}
+}
+
+
+// the endpoint just got free, the next transfer goes right out with what
+// was built in the meantime and whatever came in since
 void ep1_transmit_callback (udd_ep_status_t status,
 							iram_size_t nb_transfered, udd_ep_id_t ep) {
-
+	if (status == UDD_EP_TRANSFER_OK) {
+		if (out_len[out_fill] > 0) {
+			udi_midi_tx_stats.staged++;
+		}
+		transmit_if_idle();
+	}
 }
 
  
-// use the sof notification to check if there is something in the queue and if so start a 
-// transfer
+// transfers get started by udi_midi_flush() and chained by the completion
+// callback, the SOF is only the fallback for anything that got left over.
+// while the endpoint is busy the next transfer gets built in the other
+// buffer
 void udi_midi_sof_notify(void) {
 	udd_ep_job_t * ptr_job = udd_ep_get_job(0x82);
-	if (ptr_job != NULL && !ptr_job->busy) {
-		uint8_t n_bytes = move_queue_to_buffer();
-		if (n_bytes > 0) {
-			udd_ep_run(0x82, !(n_bytes==64) , out_buffer, n_bytes, &ep1_transmit_callback);
+	if (ptr_job != NULL) {
+		out_len[out_fill] = move_queue_to_buffer(out_len[out_fill]);
+		if (!ptr_job->busy && out_len[out_fill] > 0) {
+			udi_midi_tx_stats.from_sof++;
+			send_out_buffer();
 		}
+	}
+}
+
 
+// takes the events out of rx_buffer if they fit the ring and rearms the
+// read.  runs in the USB interrupt or with interrupts off
+static bool rx_take(void) {
+	uint16_t n_events = rx_waiting / 4;
+	uint16_t head = rx_head;
+	bool added = false;
+
+	if (UDI_MIDI_RX_RING_SIZE - (uint16_t)(head - rx_tail) < n_events) {
+		return false;
 	}
+	for (uint16_t j = 0; j < n_events; j++) {
+		// byte 0 is the cable number and code index, little endian puts it
+		// at the bottom of the word
+		uint32_t ev = ((const uint32_t *)rx_buffer)[j];
+		uint8_t cin = UDI_MIDI_CIN(ev);
+
+		// padding, the reserved codes and other cables
+		if (cin < 0x2 || UDI_MIDI_CABLE(ev) != 0) {
+			udi_midi_rx_stats.ignored++;
+			continue;
+		}
+		rx_ring[head % UDI_MIDI_RX_RING_SIZE] = ev;
+		head++;
+		added = true;
+	}
+	rx_head = head;
+	udi_midi_rx_stats.events += n_events;
+	rx_waiting = 0;
+	if (added) {
+		UDI_MIDI_RX_NOTIFY();
+	}
+	udd_ep_run(0x01, false, rx_buffer, sizeof(rx_buffer), &rx_callback);
+	return true;
 }
 
 
-volatile bool DEVICE_ENUMERATED_RUNNING = false;
+static void rx_callback(udd_ep_status_t status,
+						iram_size_t nb_transfered, udd_ep_id_t ep) {
+	if (status != UDD_EP_TRANSFER_OK) {
+		return;
+	}
+	udi_midi_rx_stats.packets++;
+	rx_waiting = (uint16_t)nb_transfered;
+	if (!rx_take()) {
+		udi_midi_rx_stats.full++;
+	}
+}
+
+
+bool udi_midi_rx_get(uint32_t *event) {
+	uint16_t tail = rx_tail;
+
+	if (tail == rx_head) {
+		return false;
+	}
+	*event = rx_ring[tail % UDI_MIDI_RX_RING_SIZE];
+	rx_tail = tail + 1;
+	// a packet that didn't fit might now
+	if (rx_waiting > 0) {
+		irqflags_t flags = cpu_irq_save();
+		if (rx_waiting > 0) {
+			rx_take();
+		}
+		cpu_irq_restore(flags);
+	}
+	return true;
+}
 
 
 	/*
@@ -168,11 +548,25 @@ bool udi_midi_enable(void)
 {
 	// setup two eps for midi
 	
-	if (udd_ep_alloc(0x82, USB_DEVICE_ENDPOINT_TYPE_BULK, 64) &&
-		udd_ep_alloc(0x01, USB_DEVICE_ENDPOINT_TYPE_BULK, 64)) {
+	if (udd_ep_alloc(0x82, USB_DEVICE_ENDPOINT_TYPE_BULK, UDI_MIDI_EP_SIZE) &&
+		udd_ep_alloc(0x01, USB_DEVICE_ENDPOINT_TYPE_BULK, UDI_MIDI_EP_SIZE)) {
 		// couldn't allocate our end points
 		return false;
 	}
+	// a new host doesn't know which NRPN was selected
+	ctrl_pack_reset();
+	cycles_per_us = system_cpu_clock_get_hz() / 1000000;
+	out_fill = 0;
+	out_buffer = out_buffers[0];
+	out_len[0] = out_len[1] = 0;
+	out_n_sampled[0] = out_n_sampled[1] = 0;
+	// whatever the last host left in the ring is stale, the same goes for a
+	// SysEx that was half way out
+	sysex_next = NULL;
+	sysex_open = false;
+	rx_waiting = 0;
+	rx_tail = rx_head;
+	udd_ep_run(0x01, false, rx_buffer, sizeof(rx_buffer), &rx_callback);
 	DEVICE_ENUMERATED_RUNNING = true;
 	return true;
 }
@@ -212,6 +606,25 @@ bool udi_midi_setup(void)
 {
 	//uint8_t port = udi_cdc_setup_to_port();
 
+	if (Udd_setup_type() == USB_REQ_TYPE_VENDOR) {
+		switch (udd_g_ctrlreq.req.bRequest) {
+		case UDI_MIDI_REQ_GET_LATENCY:
+			if (!Udd_setup_is_in()) {
+				return false;
+			}
+			latency_report = ctrl_latency_stats;
+			udd_g_ctrlreq.payload = (uint8_t *)&latency_report;
+			udd_g_ctrlreq.payload_size = min(sizeof(latency_report), udd_g_ctrlreq.req.wLength);
+			return true;
+		case UDI_MIDI_REQ_CLEAR_LATENCY:
+			if (!Udd_setup_is_out()) {
+				return false;
+			}
+			clear_latency();
+			return true;
+		}
+		return false;
+	}
 	if (Udd_setup_is_in()) {
 		// GET Interface Requests
 		if (Udd_setup_type() == USB_REQ_TYPE_CLASS) {
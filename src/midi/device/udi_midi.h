@@ -64,7 +64,129 @@ extern "C" {
 // controllers only require numbers 0-127 so we can use n > 127 to 
 // encode other 
 
-bool enqueue_ctrl(uint8_t n, uint16_t value);
+// controller n goes out as CC CTRL_CC_FIRST+n
+#define CTRL_CC_FIRST    11
+// n | CTRL_CC14 sends a 14 bit value as CC n (MSB) and CC n+32 (LSB), that
+// only works for CC numbers below 32
+#define CTRL_CC14            0x80
+// n | CTRL_NRPN sends a 14 bit value to NRPN CTRL_NRPN_FIRST+n as data
+// entry MSB / LSB (CC 6 / 38).  the parameter select (CC 99 / 98) only
+// goes out when a different NRPN was selected last on the channel, the
+// MSB always goes with it then
+#define CTRL_NRPN            0x40
+#define CTRL_NRPN_FIRST      0
+// with CTRL_LSB_ONLY set in a CC14 or NRPN value only the LSB goes out
+#define CTRL_LSB_ONLY        0x8000
+
+// sampled is the timebase stamp (see controls/timebase.h) of when the
+// frame the value came from got sampled
+bool enqueue_ctrl(uint8_t n, uint16_t value, uint32_t sampled);
+// starts a transfer with what's waiting when the endpoint is idle, the
+// main loop calls it once the values of a frame are in
+void udi_midi_flush(void);
+
+// the control store keeps the latest value per control until it goes out.
+// values that came in, the ones that replaced a value still waiting, and
+// the most controls that were ever waiting at once
+typedef struct {
+	uint32_t enqueued;
+	uint32_t coalesced;
+	uint8_t high_water;
+} ctrlq_stats_t;
+
+extern volatile ctrlq_stats_t ctrlq_stats;
+
+// priority lanes, highest first.  notes would go with the pitchbend
+enum ctrl_lane {
+	CTRL_LANE_PITCHBEND = 0,
+	CTRL_LANE_CC,
+	CTRL_N_LANES
+};
+
+// per lane: values sent and the cpu cycles from a slot starting to wait
+// until it went into a transfer, as a running average over about 16 and
+// the most
+typedef struct {
+	uint32_t sent;
+	uint32_t latency_avg;
+	uint32_t latency_max;
+} ctrlq_lane_stats_t;
+
+extern volatile ctrlq_lane_stats_t ctrlq_lane_stats[CTRL_N_LANES];
+
+// IN transfers started and the bytes in them, for the throughput.  staged
+// counts the ones that got built while the one before was still going and
+// went out the moment it finished, from_sof the ones only the SOF fallback
+// got going
+typedef struct {
+	uint32_t transfers;
+	uint32_t bytes;
+	uint32_t staged;
+	uint32_t from_sof;
+} udi_midi_tx_stats_t;
+
+extern volatile udi_midi_tx_stats_t udi_midi_tx_stats;
+
+// MIDI OUT (host to device).  the USB interrupt checks the 4 byte event
+// packets right in the receive buffer and puts the ones for cable 0 in a
+// ring of UDI_MIDI_RX_RING_SIZE, udi_midi_rx_get() takes them out outside
+// of the interrupt.  an event is the packet as a little endian word: the
+// code index number at the bottom, then the three MIDI bytes.  while the
+// ring is full the host gets NAKed, nothing is dropped
+#define UDI_MIDI_CIN(ev)       ((uint8_t)((ev) & 0x0f))
+#define UDI_MIDI_CABLE(ev)     ((uint8_t)(((ev) >> 4) & 0x0f))
+// MIDI byte k (0-2) of an event
+#define UDI_MIDI_BYTE(ev, k)   ((uint8_t)((ev) >> (8 * (k) + 8)))
+
+bool udi_midi_rx_get(uint32_t *event);
+
+// outgoing SysEx.  next() gives out the message a byte at a time, F0 to
+// F7, and -1 once it's done (a missing F7 gets added, a source that's done
+// right away sends nothing).  it's called from the USB interrupt (or with
+// it masked) whenever an IN transfer has room left after the controls,
+// each call fills one event packet, so a message of any size goes out
+// without being copied.  ctx has to stay around until udi_midi_sysex_busy()
+// is false.  udi_midi_sysex_send() returns false while one is still going
+typedef int16_t (*udi_midi_sysex_source_t)(void *ctx);
+
+bool udi_midi_sysex_send(udi_midi_sysex_source_t next, void *ctx);
+bool udi_midi_sysex_busy(void);
+
+// USB packets and events received, events that got dropped (padding,
+// reserved codes, other cables) and the times the ring was too full to
+// take a packet right away
+typedef struct {
+	uint32_t packets;
+	uint32_t events;
+	uint32_t ignored;
+	uint32_t full;
+} udi_midi_rx_stats_t;
+
+extern volatile udi_midi_rx_stats_t udi_midi_rx_stats;
+
+// end to end latency in microseconds, from a value's frame getting sampled
+// until the transfer it went out in got handed to the USB hardware.
+// avg_us is a running average over about 16 values, hist[k] counts the
+// ones that took k*CTRL_LATENCY_BUCKET_US up to the next bucket, the last
+// bucket everything beyond
+#define CTRL_LATENCY_BUCKETS     16
+#define CTRL_LATENCY_BUCKET_US   250
+
+typedef struct {
+	uint32_t events;
+	uint32_t min_us;
+	uint32_t avg_us;
+	uint32_t max_us;
+	uint32_t hist[CTRL_LATENCY_BUCKETS];
+} ctrl_latency_stats_t;
+
+extern volatile ctrl_latency_stats_t ctrl_latency_stats;
+
+// vendor requests to the MIDI interface.  GET_LATENCY (device to host)
+// returns ctrl_latency_stats as it is, little endian, CLEAR_LATENCY (host
+// to device, no data) starts it over
+#define UDI_MIDI_REQ_GET_LATENCY     0x01
+#define UDI_MIDI_REQ_CLEAR_LATENCY   0x02
 
 
 
@@ -58,6 +58,19 @@ extern "C" {
 //! Control endpoint size (Endpoint 0)
 #define  USB_DEVICE_EP_CTRL_SIZE       64
 
+//! Size of each of the two IN transfer buffers, whole 64 byte packets.
+//! A burst of changes goes out as one transfer of up to this many bytes.
+//! All 64 controls take 256 bytes as plain CCs, up to 1024 as NRPNs
+#define  UDI_MIDI_TX_BUFFER_SIZE       512
+
+//! Number of received events the ring holds (a power of 2), 16 per packet
+#define  UDI_MIDI_RX_RING_SIZE         256
+
+//! Called from the USB interrupt when received events went into the ring
+#ifndef  UDI_MIDI_RX_NOTIFY
+#  define  UDI_MIDI_RX_NOTIFY()
+#endif
+
 
 #ifdef __cplusplus
 }
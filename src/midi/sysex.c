@@ -0,0 +1,109 @@
+#include <asf.h>
+#include "midi/sysex.h"
+#include "midi/device/udi_midi.h"
+
+
+void
+sysex_rx_init(sysex_rx_t *rx, sysex_sink_t sink)
+{
+	rx->sink = sink;
+	rx->len = 0;
+	rx->active = false;
+	rx->first = false;
+}
+
+
+static void
+sysex_flush(sysex_rx_t *rx, uint8_t flags)
+{
+	rx->sink(rx->buf, rx->len, (rx->first ? SYSEX_START : 0) | flags);
+	rx->first = false;
+	rx->len = 0;
+}
+
+
+static void
+sysex_abort(sysex_rx_t *rx)
+{
+	if (rx->active) {
+		sysex_flush(rx, SYSEX_END | SYSEX_ABORTED);
+		rx->active = false;
+	}
+}
+
+
+static void
+sysex_byte(sysex_rx_t *rx, uint8_t b)
+{
+	if (b == 0xf0) {
+		sysex_abort(rx);
+		rx->active = true;
+		rx->first = true;
+	} else if (!rx->active) {
+		// the rest of a message we didn't see the start of
+		return;
+	} else if (b & 0x80 && b != 0xf7) {
+		sysex_abort(rx);
+		return;
+	}
+	rx->buf[rx->len++] = b;
+	if (b == 0xf7) {
+		sysex_flush(rx, SYSEX_END);
+		rx->active = false;
+	} else if (rx->len == SYSEX_RX_CHUNK) {
+		sysex_flush(rx, 0);
+	}
+}
+
+
+bool
+sysex_rx_event(sysex_rx_t *rx, uint32_t event)
+{
+	uint8_t n;
+
+	switch (UDI_MIDI_CIN(event)) {
+	case 0x4:
+	case 0x7:
+		n = 3;
+		break;
+	case 0x6:
+		n = 2;
+		break;
+	case 0x5:
+		// a single byte system common message unless it's the F7
+		if (UDI_MIDI_BYTE(event, 0) != 0xf7) {
+			sysex_abort(rx);
+			return false;
+		}
+		n = 1;
+		break;
+	case 0xf:
+		// single bytes, realtime ones can come in the middle of a message
+		if (UDI_MIDI_BYTE(event, 0) >= 0xf8) {
+			return false;
+		}
+		n = 1;
+		break;
+	default:
+		// any other status ends a message
+		sysex_abort(rx);
+		return false;
+	}
+	for (uint8_t k = 0; k < n; k++) {
+		sysex_byte(rx, UDI_MIDI_BYTE(event, k));
+	}
+	return true;
+}
+
+
+int16_t
+sysex_buffer_next(void *ctx)
+{
+	sysex_buffer_t *b = (sysex_buffer_t *)ctx;
+
+	if (b->left == 0) {
+		return -1;
+	}
+	b->left--;
+	return *b->data++;
+}
@@ -0,0 +1,53 @@
+#ifndef _SYSEX_H_
+#define _SYSEX_H_
+
+#include <asf.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// streaming SysEx reassembly.  the bytes of the CIN 0x4-0x7 event packets
+// are collected in a chunk of SYSEX_RX_CHUNK and handed to the sink every
+// time it fills up and when the message ends, so a message of any length
+// only ever takes one chunk of RAM.  the sink has to deal with a message
+// coming in pieces
+
+#define SYSEX_RX_CHUNK   32
+
+// the chunk starts the message (with the F0)
+#define SYSEX_START      0x01
+// the chunk ends the message, with the F7 unless it got cut off
+#define SYSEX_END        0x02
+// another status byte cut the message off, it's incomplete
+#define SYSEX_ABORTED    0x04
+
+typedef void (*sysex_sink_t)(const uint8_t *data, uint8_t len, uint8_t flags);
+
+typedef struct {
+	sysex_sink_t sink;
+	uint8_t buf[SYSEX_RX_CHUNK];
+	uint8_t len;
+	bool active;
+	bool first;
+} sysex_rx_t;
+
+void sysex_rx_init(sysex_rx_t *rx, sysex_sink_t sink);
+// feed every received event through here, returns false for the ones that
+// aren't part of a SysEx message
+bool sysex_rx_event(sysex_rx_t *rx, uint32_t event);
+
+// outgoing SysEx gets pulled out of a source a byte at a time as the IN
+// buffer has room, see udi_midi_sysex_send().  this one reads a message
+// that's already in memory
+typedef struct {
+	const uint8_t *data;
+	uint16_t left;
+} sysex_buffer_t;
+
+int16_t sysex_buffer_next(void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // _SYSEX_H_
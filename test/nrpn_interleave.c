@@ -0,0 +1,92 @@
+// host test for the NRPN packing, with src/midi/ctrl_pack.c, see the
+// README for how to build it.
+// two NRPN controls change in turns and at random, with the LSB-only
+// short form whenever the MSB stayed the same (as handle_ctrl14_value()
+// does it).  a receiver that keeps one data entry MSB for whatever is
+// selected has to end up with every value that went out
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "midi/ctrl_pack.h"
+#include "midi/device/udi_midi.h"
+
+#define N_NRPN   2
+
+// what the receiver holds
+static uint16_t selected = 0xffff;
+static uint8_t entry_msb = 0;
+static uint16_t param_value[128];
+static int failed = 0;
+
+
+static void
+receive(const uint8_t *p)
+{
+	if (p[0] != 0x0b || p[1] != 0xb0) {
+		printf("not a CC on channel 0: %02x %02x\n", p[0], p[1]);
+		failed++;
+		return;
+	}
+	switch (p[2]) {
+	case 99:
+		selected = (uint16_t)((p[3] << 7) | (selected & 0x7f));
+		break;
+	case 98:
+		selected = (uint16_t)((selected & 0x3f80) | p[3]);
+		break;
+	case 6:
+		// a new MSB resets the LSB
+		entry_msb = p[3];
+		param_value[selected & 0x7f] = (uint16_t)(entry_msb << 7);
+		break;
+	case 38:
+		param_value[selected & 0x7f] = (uint16_t)((entry_msb << 7) | p[3]);
+		break;
+	default:
+		printf("unexpected CC %u\n", p[2]);
+		failed++;
+	}
+}
+
+
+int
+main(void)
+{
+	uint8_t msb_sent[N_NRPN] = { 0xff, 0xff };
+	uint8_t buf[16];
+
+	ctrl_pack_reset();
+	for (int k = 0; k < 20000; k++) {
+		// in turns for a while, then at random
+		uint8_t i = (k < 1000) ? (uint8_t)(k & 1) : (uint8_t)(rand() % N_NRPN);
+		uint16_t value = (uint16_t)(rand() & 0x3fff);
+
+		// mostly small moves, those keep the MSB
+		if (k % 7 && msb_sent[i] != 0xff) {
+			value = (uint16_t)((msb_sent[i] << 7) | (value & 0x7f));
+		}
+		uint16_t flags = ((value >> 7) == msb_sent[i]) ? CTRL_LSB_ONLY : 0;
+		uint8_t n = i | CTRL_NRPN;
+		uint8_t size = ctrl_pack_size(n, value | flags);
+		uint8_t len = ctrl_pack(buf, n, value | flags);
+
+		if (len != size) {
+			printf("step %d: ctrl_pack_size() said %u, ctrl_pack() put out %u\n", k, size, len);
+			failed++;
+		}
+		for (uint8_t j = 0; j < len; j += 4) {
+			receive(&buf[j]);
+		}
+		msb_sent[i] = (uint8_t)(value >> 7);
+		if (param_value[CTRL_NRPN_FIRST + i] != value) {
+			printf("step %d: NRPN %u got %u instead of %u\n",
+				k, CTRL_NRPN_FIRST + i, param_value[CTRL_NRPN_FIRST + i], value);
+			if (++failed > 10) {
+				break;
+			}
+		}
+	}
+
+	printf("%s\n", failed ? "FAILED" : "ok");
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,145 @@
+// host test for the pitchbend transfer, with src/controls/calibration.c
+// and src/controls/pitchbend.c, see the README for how to build it.
+// walks the pitchbend control through a few calibrations and checks all
+// 4096 raw values against the transfer worked out in floating point from
+// the learned range, plus that it only goes up, hits the ends and the
+// center exactly and that pitchbend_unapply() finds the right raw value
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "controls/calibration.h"
+#include "controls/pitchbend.h"
+
+// calibration.c counts in scanned frames
+volatile uint32_t adc_scan_frame_count = 0;
+
+static const uint8_t ctrl_type[N_CTRLS] = CONTROL_MAP_TYPES;
+static uint8_t pb;
+static int failed = 0;
+
+// the fixed point rounding is worth a count, the curve is up to
+// three times as steep as the straight line
+#define TOLERANCE   (CONF_PITCHBEND_CURVE ? 4 : 1)
+
+// what the test fed the calibration
+static int seen_min = 4096, seen_max = -1, rest = -1;
+
+
+static int
+deadband(int value)
+{
+	if (value > 8192 - CONF_PITCHBEND_DEADBAND && value < 8192 + CONF_PITCHBEND_DEADBAND) {
+		return 8192;
+	}
+	return value;
+}
+
+
+// the output for raw as a real number, before the deadband.  an end point
+// counts once the control got within CONF_CALIB_EDGE of it, the rest
+// position once it's inside the range
+static double
+reference(int raw, int *lo_out, int *hi_out, int *center_out)
+{
+	int lo = (seen_min <= CONF_CALIB_EDGE) ? seen_min : 0;
+	int hi = (seen_max >= 4095 - CONF_CALIB_EDGE) ? seen_max : 4095;
+	int center = (rest > lo && rest < hi) ? rest : (lo + hi + 1) / 2;
+	double v;
+
+	*lo_out = lo;
+	*hi_out = hi;
+	*center_out = center;
+	if (raw >= center) {
+		v = 8192 + (raw - center) * 8191.0 / (hi - center);
+	} else {
+		v = 8192 - (center - raw) * 8192.0 / (center - lo);
+	}
+	v = (v < 0) ? 0 : (v > 16383) ? 16383 : v;
+#if CONF_PITCHBEND_CURVE
+	double d = v - 8192, range = (d < 0) ? 8192 : 8191;
+	v = 8192 + d - CONF_PITCHBEND_CURVE / 100.0 * (d - d * d * d / (range * range));
+#endif
+	return v;
+}
+
+
+static void
+check(const char *what)
+{
+	int last = 0, lo, hi, center;
+
+	for (int raw = 0; raw < 4096; raw++) {
+		int value = pitchbend_lookup(pb, (uint16_t)raw);
+		double v = reference(raw, &lo, &hi, &center);
+		bool near = false;
+
+		// v isn't negative, (int) rounds it down
+		for (int c = (int)v - TOLERANCE; c <= (int)v + 1 + TOLERANCE; c++) {
+			near = near || (value == deadband(c));
+		}
+		if (!near) {
+			printf("%s: raw %d gives %d, should be about %.1f\n", what, raw, value, v);
+			failed++;
+			return;
+		}
+		if ((raw <= lo && value != 0) || (raw >= hi && value != 16383) ||
+				(raw == center && value != 8192)) {
+			printf("%s: raw %d gives %d, the end points are %d and %d, the center %d\n",
+				what, raw, value, lo, hi, center);
+			failed++;
+			return;
+		}
+		if (value < last) {
+			printf("%s: goes down at raw %d\n", what, raw);
+			failed++;
+			return;
+		}
+		last = value;
+	}
+	for (int out = 0; out <= 16383; out += 7) {
+		int raw = pitchbend_unapply(pb, (uint16_t)out);
+		if ((raw < 4096 && pitchbend_lookup(pb, (uint16_t)raw) < out) ||
+				(raw > 0 && pitchbend_lookup(pb, (uint16_t)(raw - 1)) >= out)) {
+			printf("%s: unapply(%d) gives %d\n", what, out, raw);
+			failed++;
+			return;
+		}
+	}
+}
+
+
+static void
+play(int raw, const char *what)
+{
+	calib_extend(pb, (uint16_t)raw);
+	seen_min = (raw < seen_min) ? raw : seen_min;
+	seen_max = (raw > seen_max) ? raw : seen_max;
+	check(what);
+}
+
+
+int
+main(void)
+{
+	for (uint8_t i = 0; i < N_CTRLS; i++) {
+		if (ctrl_type[i] == CTRL_TYPE_PITCHBEND) {
+			pb = i;
+		}
+	}
+	calib_init();
+	check("startup");
+
+	play(2048, "first reading");
+	play(1000, "no end yet");
+	play(12, "low end");
+	play(4083, "high end");
+	play(5, "lower end");
+	play(4090, "higher end");
+
+	calib_ranges[pb].center = 1900;
+	rest = 1900;
+	play(3, "rest position");
+
+	printf("%s\n", failed ? "FAILED" : "ok");
+	return failed ? 1 : 0;
+}